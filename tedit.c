@@ -10,16 +10,37 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(TEDIT_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 /*** defines ***/
 
 #define TEDIT_VERSION "0.0.1"
 #define TAB_STOP 4
 #define QUIT_TIMES 2
+#define OPEN_BATCH 65536        // rows added per editorInsertRows() on open
+#define WHEEL_LINES 3           // lines scrolled per mouse wheel notch
+
+#ifndef TEDIT_SYNTAX_DIR
+#define TEDIT_SYNTAX_DIR "/usr/local/share/tedit/syntax"
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)           // turns off bit 7, 6 and 5 of the char
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
@@ -35,7 +56,11 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    MOUSE_CLICK,        // left button press at E.mouse_x, E.mouse_y
+    MOUSE_WHEEL_UP,
+    MOUSE_WHEEL_DOWN,
+    MOUSE_EVENT         // any other mouse report, ignored
 };
 
 enum editorHighlight {
@@ -51,6 +76,14 @@ enum editorHighlight {
 
 /*** data ***/
 
+// node of the keyword trie, siblings are chained through 'next'
+struct kwnode {
+    unsigned char c;
+    unsigned char type;     // HL_KEYWORD1/2 if a keyword ends here
+    int child;
+    int next;
+};
+
 struct editorSyntax {
 	char *filetype;
 	char **filematch;
@@ -59,19 +92,152 @@ struct editorSyntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+    char *quotes;           // string delimiters, "\"'" if NULL
+    char *separators;       // extra separators besides whitespace, if set
+    char *path;             // definition file, NULL for built-in entries
+
+    // filled by syntaxCompile()
+    int compiled;
+    unsigned char sep[256];
+    unsigned char quote[256];
+    int kwroot[256];        // trie node for each first byte, -1 if none
+    struct kwnode *kwtrie;
+    int kwnodes;
 };
 
 // Stores row of text in editor
 typedef struct erow {
  	int idx;   
 	int size;
+    int isize;  // size last recorded in E.lineidx
     int rsize;
     char *chars;
     char *render;
-	unsigned char *hl;
+    int *rmap;      // chars offset -> render offset, NULL when they coincide
+    int *rcol;      // render offset -> screen column, NULL for pure ASCII rows
+    int *ctrl;      // render offsets of control bytes, in order
+    int nctrl;
+    int *wraps;     // render offset of each visual line, see editorRowWrapLines
+    int nwraps;     // visual lines at width wrapw
+    int wrapw;      // 0 when the layout is out of date
+    int iwraps;     // nwraps last recorded in E.wrapidx
+	unsigned char *hl;      // highlight runs, see hlStore
+	int hllen;
 	int hl_open_comment;
+    int *words;     // E.words nodes of the row's words, in order
+    int nwords;
 } erow;
 
+// Word completion index: a trie of the buffer's words, see wordsIndexRow.
+// Siblings are chained through 'next'.
+struct wordNode {
+    unsigned char c;
+    unsigned char len;  // of the word ending here
+    int parent;
+    int child;
+    int next;
+    int count;      // occurrences of the word ending here
+    int best;       // highest count of a word ending here or below
+    char *word;     // its text once it's been seen as a word, else NULL
+};
+
+struct wordSlot {
+    unsigned long long hash;
+    int node;           // node + 1, 0 if free
+};
+
+struct wordIndex {
+    struct wordNode *nodes;     // nodes[0] is the root
+    int n, cap;
+    int free;                   // first unused node, chained through next
+    struct wordSlot *slot;      // hash table of the words seen, by text
+    int nslot, nwords;
+    int built;                  // off until the first completion
+};
+
+// A piece of text to insert as a row. When base is set, s points into the
+// shared text block base and a reference to it is held.
+struct textSpan {
+    char *base;
+    char *s;
+    int len;
+};
+
+enum editorSelection {
+    SEL_NONE = 0,
+    SEL_LINES,
+    SEL_BLOCK
+};
+
+// The clipboard is a list of spans into the buffer's own text blocks: one
+// per row for both line and block selections.
+struct clipboard {
+    struct textSpan *spans;
+    int n;
+    int lines;      // whole lines rather than a block
+};
+
+// Prefix sums over a sequence of values. Point updates, appends and prefix
+// queries are O(log n).
+struct fenwick {
+    long long *tree;    // 1-based
+    int n;
+    int cap;
+};
+
+// Prefix sums over a per-row quantity. Rows are grouped into chunks of
+// consecutive rows, each holding its rows' values; Fenwick trees over the
+// chunks give the rows and the total before any chunk. Point updates,
+// inserting or deleting rows anywhere and prefix queries are O(log n) plus
+// work within one chunk; only splitting or dropping a chunk in the middle
+// rebuilds the trees, over the chunks rather than the rows. A stale index
+// keeps nothing and is rebuilt in O(n) on the next query.
+struct rowIndex {
+    int **v;                    // values of each chunk's rows
+    long long *cnt;             // rows in each chunk, never 0
+    long long *sum;             // their total
+    int nchunks;
+    int cap;                    // v[nchunks .. cap - 1] keep the buffers of
+                                // dropped chunks for new ones, or are NULL
+    struct fenwick count;       // over cnt
+    struct fenwick total;       // over sum
+    int n;                      // rows
+    int stale;
+};
+
+#ifdef TEDIT_PROFILE
+enum perfSlot {
+    PERF_INPUT = 0,
+    PERF_SCROLL,
+    PERF_DRAW,
+    PERF_SYNTAX,
+    PERF_WRITE,
+    PERF_SLOTS
+};
+
+struct perfFrame {
+    unsigned long long ticks[PERF_SLOTS];
+    long allocs;
+    long rows_highlighted;
+    long bytes_written;
+};
+
+struct editorProfile {
+    struct perfFrame cur;       // frame being measured
+    struct perfFrame last;      // last complete frame, shown by the HUD
+    long frames;
+    double ticks_per_us;
+    int hud;
+    FILE *dump;
+};
+#endif
+
+// work counters, reset for every keystroke
+struct editorStats {
+    long rendered;      // bytes of render rebuilt or patched
+    long highlighted;   // bytes passed through the highlighter
+};
+
 // Keeps track of global editor state
 struct editorConfig{
     // cx --> horizontal coordinate of cursor(columns) 
@@ -80,20 +246,46 @@ struct editorConfig{
     int rx; 
     int screenrows;
     int screencols;
+    int gutter;     // columns taken by the diff gutter, left of the text
     int rowoff;
     int coloff;
     int numrows;
+    int rowcap;     // rows allocated in E.row
     int dirty;
     erow *row;
+    struct rowIndex lineidx;    // byte length (including '\n') of each row
+    struct wordIndex words;     // for completion
+    int wrap;                   // soft wrap on
+    long long voff;             // first visual line on screen, when wrapping
+    struct rowIndex wrapidx;    // visual lines of each row, when wrapping
+    int wrapidx_w;              // screen width wrapidx was built for
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    int headless;           // batch mode: no terminal, no highlighting
+    int sel_mode;
+    int sel_cx, sel_cy;     // selection anchor
+    int match_row;          // search match drawn over the highlighting
+    int match_start, match_end;
+    int mouse_x, mouse_y;   // screen cell of the last MOUSE_CLICK, 0-based
+    int pending_key;        // read ahead while coalescing wheel events, or -1
+    int scroll_only;        // only the view moved since the last frame
+    void (*idle)(void);     // called while editorReadKey waits for input
+    long long drawn_off;    // rowoff, or voff when wrapping, of the last frame
+    int drawn_coloff;
+    struct clipboard clip;
+    struct editorStats stats;
+#ifdef TEDIT_PROFILE
+    struct editorProfile prof;
+#endif
 	struct termios orig_termios;
 };
 
 
-struct editorConfig E;   // global editor state object
+// Editor state. Thread local so that batch mode can run one editor per
+// worker thread.
+_Thread_local struct editorConfig E;
 
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
 char *C_HL_keywords[] = {
@@ -109,7 +301,8 @@ struct editorSyntax HLDB[] = {
 		C_HL_extensions,
 		C_HL_keywords,
 		"//","/*","*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		.path = NULL
 	},
 };
 
@@ -119,7 +312,44 @@ struct editorSyntax HLDB[] = {
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorDiffEdit(int at, int n, int delta);
+void editorUpdateSyntax(erow *row);
+int editorHighlightFrom(erow *row, unsigned char *hl, int from, int stable);
+void wordsIndexRow(erow *row, const unsigned char *hl);
+void wordsUnindexRow(erow *row);
+void journalInsert(int row, int at, const char *s, int len);
+void journalDelete(int row, int at, int len);
+void journalRows(int at, struct textSpan *spans, int n);
+void journalDelRows(int at, int n);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorOpen(char *filename);
+
+/*** profiling ***/
+
+// Probes only exist in builds made with -DTEDIT_PROFILE ("make profile").
+#ifdef TEDIT_PROFILE
+
+unsigned long long perfNow() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+#define PROBE_BEGIN(slot) unsigned long long probe_##slot = perfNow()
+#define PROBE_END(slot) (E.prof.cur.ticks[slot] += perfNow() - probe_##slot)
+#define PERF_COUNT(counter, n) (E.prof.cur.counter += (n))
+
+#else
+
+#define PROBE_BEGIN(slot) ((void)0)
+#define PROBE_END(slot) ((void)0)
+#define PERF_COUNT(counter, n) ((void)0)
+
+#endif
 
 /*** append buffer **/
 struct abuf{
@@ -131,6 +361,7 @@ struct abuf{
 
 void abAppend(struct abuf *ab, const char *s, int len){
     char *new = realloc(ab->b, ab->len + len);
+    PERF_COUNT(allocs, 1);
 
     if(new == NULL)
         return;
@@ -139,10 +370,467 @@ void abAppend(struct abuf *ab, const char *s, int len){
     ab->len += len;
 }
 
+// Appends text that came from outside, such as a file name, with control
+// bytes shown as '?' so they can't reach the terminal as escapes.
+void abAppendPrintable(struct abuf *ab, const char *s, int len){
+    int start = 0;
+    for(int i = 0; i < len; i++) {
+        if((unsigned char)s[i] >= 0x20 && s[i] != 0x7f)
+            continue;
+        abAppend(ab, s + start, i - start);
+        abAppend(ab, "?", 1);
+        start = i + 1;
+    }
+    abAppend(ab, s + start, len - start);
+}
+
 void abFree(struct abuf *ab){
     free(ab->b);
 }
 
+/*** fenwick tree ***/
+
+#define LOWBIT(i) ((i) & -(i))
+
+void fenwickReserve(struct fenwick *f, int n) {
+    if(n <= f->cap)
+        return;
+    int cap = f->cap ? f->cap : 64;
+    while(cap < n)
+        cap *= 2;
+    f->tree = realloc(f->tree, sizeof(long long) * (cap + 1));
+    f->cap = cap;
+}
+
+void fenwickBuild(struct fenwick *f, int n, const long long *value) {
+    fenwickReserve(f, n);
+    int i;
+    for(i = 1; i <= n; i++)
+        f->tree[i] = value[i - 1];
+    for(i = 1; i <= n; i++) {
+        int j = i + LOWBIT(i);
+        if(j <= n)
+            f->tree[j] += f->tree[i];
+    }
+    f->n = n;
+}
+
+// sum of the first n values
+long long fenwickPrefix(struct fenwick *f, int n) {
+    long long sum = 0;
+    if(n > f->n)
+        n = f->n;
+    for(; n > 0; n -= LOWBIT(n))
+        sum += f->tree[n];
+    return sum;
+}
+
+void fenwickAdd(struct fenwick *f, int at, long long delta) {
+    if(delta == 0)
+        return;
+    for(at++; at <= f->n; at += LOWBIT(at))
+        f->tree[at] += delta;
+}
+
+void fenwickAppend(struct fenwick *f, long long value) {
+    fenwickReserve(f, f->n + 1);
+    int i = ++f->n;
+    f->tree[i] = value + fenwickPrefix(f, i - 1) - fenwickPrefix(f, i - LOWBIT(i));
+}
+
+// index of the value containing offset 'target', i.e. the largest i such
+// that the sum of the first i values is <= target. Values must be >= 0.
+int fenwickSearch(struct fenwick *f, long long target) {
+    int pos = 0;
+    int step = 1;
+    while(step * 2 <= f->n)
+        step *= 2;
+    for(; step > 0; step /= 2) {
+        if(pos + step <= f->n && f->tree[pos + step] <= target) {
+            pos += step;
+            target -= f->tree[pos];
+        }
+    }
+    return pos;
+}
+
+/*** row index ***/
+
+#define ROWIDX_CHUNK 1024   // rows per chunk after a split; chunks split at twice that
+
+void rowIndexSums(struct rowIndex *x) {
+    fenwickBuild(&x->count, x->nchunks, x->cnt);
+    fenwickBuild(&x->total, x->nchunks, x->sum);
+}
+
+// Makes n empty chunks at c, after the ones before it. The trees are left
+// for the caller to update.
+void rowIndexOpen(struct rowIndex *x, int c, int n) {
+    if(x->nchunks + n > x->cap) {
+        int cap = x->cap * 2 > x->nchunks + n ? x->cap * 2 : x->nchunks + n;
+        x->v = realloc(x->v, sizeof(int *) * cap);
+        x->cnt = realloc(x->cnt, sizeof(long long) * cap);
+        x->sum = realloc(x->sum, sizeof(long long) * cap);
+        memset(&x->v[x->cap], 0, sizeof(int *) * (cap - x->cap));
+        x->cap = cap;
+    }
+    // the buffers past the last chunk move down to the new ones
+    int tail = x->nchunks - c;
+    int **spare = tail ? malloc(sizeof(int *) * n) : &x->v[c];
+    if(tail) {
+        memcpy(spare, &x->v[x->nchunks], sizeof(int *) * n);
+        memmove(&x->v[c + n], &x->v[c], sizeof(int *) * tail);
+        memcpy(&x->v[c], spare, sizeof(int *) * n);
+        free(spare);
+    }
+    memmove(&x->cnt[c + n], &x->cnt[c], sizeof(long long) * tail);
+    memmove(&x->sum[c + n], &x->sum[c], sizeof(long long) * tail);
+    for(int k = c; k < c + n; k++) {
+        if(x->v[k] == NULL)
+            x->v[k] = malloc(sizeof(int) * ROWIDX_CHUNK * 2);
+        x->cnt[k] = 0;
+        x->sum[k] = 0;
+    }
+    x->nchunks += n;
+}
+
+// The chunks' buffers are kept for reuse rather than freed. Besides the
+// mallocs saved, a big delete then doesn't free thousands of buffers at
+// once and pay for malloc to consolidate every row freed just before.
+void rowIndexClear(struct rowIndex *x) {
+    x->nchunks = 0;
+    x->n = 0;
+    x->count.n = 0;
+    x->total.n = 0;
+}
+
+void rowIndexFree(struct rowIndex *x) {
+    for(int k = 0; k < x->cap; k++)
+        free(x->v[k]);
+    free(x->v);
+    free(x->cnt);
+    free(x->sum);
+    free(x->count.tree);
+    free(x->total.tree);
+}
+
+void rowIndexBuild(struct rowIndex *x, int n, long long (*value)(int)) {
+    rowIndexClear(x);
+    int chunks = (n + ROWIDX_CHUNK - 1) / ROWIDX_CHUNK;
+    rowIndexOpen(x, 0, chunks);
+    for(int i = 0; i < n; i++) {
+        int c = i / ROWIDX_CHUNK;
+        x->v[c][x->cnt[c]++] = value(i);
+        x->sum[c] += x->v[c][x->cnt[c] - 1];
+    }
+    x->n = n;
+    x->stale = 0;
+    rowIndexSums(x);
+}
+
+// chunk holding row 'at', and the row's place in it
+int rowIndexFind(struct rowIndex *x, int at, int *pos) {
+    int c = fenwickSearch(&x->count, at);
+    *pos = at - fenwickPrefix(&x->count, c);
+    return c;
+}
+
+// sum of the values of the first 'at' rows
+long long rowIndexPrefix(struct rowIndex *x, int at) {
+    if(at >= x->n)
+        return fenwickPrefix(&x->total, x->nchunks);
+    int pos, c = rowIndexFind(x, at, &pos);
+    long long sum = fenwickPrefix(&x->total, c);
+    for(int k = 0; k < pos; k++)
+        sum += x->v[c][k];
+    return sum;
+}
+
+// the largest i such that the first i rows sum to <= target
+int rowIndexSearch(struct rowIndex *x, long long target) {
+    int c = fenwickSearch(&x->total, target);
+    if(c == x->nchunks)
+        return x->n;
+    target -= fenwickPrefix(&x->total, c);
+    int k = 0;
+    while(k < x->cnt[c] && x->v[c][k] <= target)
+        target -= x->v[c][k++];
+    return fenwickPrefix(&x->count, c) + k;
+}
+
+void rowIndexAdd(struct rowIndex *x, int at, long long delta) {
+    if(x->stale || delta == 0 || at >= x->n)
+        return;
+    int pos, c = rowIndexFind(x, at, &pos);
+    x->v[c][pos] += delta;
+    x->sum[c] += delta;
+    fenwickAdd(&x->total, c, delta);
+}
+
+// Adds n rows before row 'at', row at + k having value(at + k), or 0 with
+// no value function. A chunk that overflows is split in place.
+void rowIndexInsert(struct rowIndex *x, int at, int n, long long (*value)(int)) {
+    if(x->stale || at > x->n || n <= 0)
+        return;
+    if(x->nchunks == 0) {
+        rowIndexOpen(x, 0, 1);
+        fenwickAppend(&x->count, 0);
+        fenwickAppend(&x->total, 0);
+    }
+    // at the end of the chunk before rather than the start of the next, so
+    // that appending grows the last chunk
+    int pos = 0, c = at > 0 ? rowIndexFind(x, at - 1, &pos) : 0;
+    if(at > 0)
+        pos++;
+
+    int total = x->cnt[c] + n;
+    int *all = x->v[c];
+    if(total > ROWIDX_CHUNK * 2) {
+        all = malloc(sizeof(int) * total);
+        memcpy(all, x->v[c], sizeof(int) * pos);
+    }
+    memmove(&all[pos + n], &x->v[c][pos], sizeof(int) * (x->cnt[c] - pos));
+    long long added = 0;
+    for(int k = 0; k < n; k++) {
+        all[pos + k] = value ? value(at + k) : 0;
+        added += all[pos + k];
+    }
+    x->n += n;
+    if(all == x->v[c]) {
+        x->cnt[c] += n;
+        x->sum[c] += added;
+        fenwickAdd(&x->count, c, n);
+        fenwickAdd(&x->total, c, added);
+        return;
+    }
+
+    int pieces = (total + ROWIDX_CHUNK - 1) / ROWIDX_CHUNK;
+    int last = c == x->nchunks - 1;
+    long long oldcnt = x->cnt[c], oldsum = x->sum[c];
+    rowIndexOpen(x, c + 1, pieces - 1);
+    for(int p = 0; p < pieces; p++) {
+        int from = p * ROWIDX_CHUNK, m = total - from < ROWIDX_CHUNK ? total - from : ROWIDX_CHUNK;
+        memcpy(x->v[c + p], &all[from], sizeof(int) * m);
+        x->cnt[c + p] = m;
+        x->sum[c + p] = 0;
+        for(int k = 0; k < m; k++)
+            x->sum[c + p] += all[from + k];
+    }
+    free(all);
+    if(last) {
+        // appending, as when a file is read in: only new trailing chunks
+        fenwickAdd(&x->count, c, x->cnt[c] - oldcnt);
+        fenwickAdd(&x->total, c, x->sum[c] - oldsum);
+        for(int p = 1; p < pieces; p++) {
+            fenwickAppend(&x->count, x->cnt[c + p]);
+            fenwickAppend(&x->total, x->sum[c + p]);
+        }
+    } else {
+        rowIndexSums(x);
+    }
+}
+
+// Removes rows at .. at + n - 1. Chunks left empty are dropped.
+void rowIndexDelete(struct rowIndex *x, int at, int n) {
+    if(x->stale || at >= x->n || n <= 0)
+        return;
+    if(n > x->n - at)
+        n = x->n - at;
+    int pos, c = rowIndexFind(x, at, &pos);
+    int emptied = 0;
+    x->n -= n;
+    for(; n > 0; c++, pos = 0) {
+        int m = x->cnt[c] - pos < n ? x->cnt[c] - pos : n;
+        long long removed = 0;
+        for(int k = 0; k < m; k++)
+            removed += x->v[c][pos + k];
+        memmove(&x->v[c][pos], &x->v[c][pos + m], sizeof(int) * (x->cnt[c] - pos - m));
+        x->cnt[c] -= m;
+        x->sum[c] -= removed;
+        fenwickAdd(&x->count, c, -m);
+        fenwickAdd(&x->total, c, -removed);
+        emptied |= x->cnt[c] == 0;
+        n -= m;
+    }
+    if(!emptied)
+        return;
+    int kept = 0;
+    for(int k = 0; k < x->nchunks; k++) {
+        if(x->cnt[k] == 0)
+            continue;
+        // the empty chunk's buffer goes past the ones kept
+        int *v = x->v[kept];
+        x->v[kept] = x->v[k];
+        x->v[k] = v;
+        x->cnt[kept] = x->cnt[k];
+        x->sum[kept] = x->sum[k];
+        kept++;
+    }
+    x->nchunks = kept;
+    rowIndexSums(x);
+}
+
+/*** worker threads ***/
+
+struct worker {
+    pthread_t tid;
+    int started;
+};
+
+// Runs fn(arg) on a new thread, or right here if no thread can be had,
+// so the work gets done either way.
+void workerStart(struct worker *w, void *(*fn)(void *), void *arg) {
+    w->started = pthread_create(&w->tid, NULL, fn, arg) == 0;
+    if(!w->started)
+        fn(arg);
+}
+
+void workerJoin(struct worker *w) {
+    if(w->started)
+        pthread_join(w->tid, NULL);
+}
+
+/*** utf-8 ***/
+
+struct interval {
+    int first;
+    int last;
+};
+
+// zero width: combining marks, variation selectors, zero width joiners
+static const struct interval utf8_zero_width[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x0900, 0x0902}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D},
+    {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF},
+    {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x20D0, 0x20FF}, {0xFE00, 0xFE0F},
+    {0xFE20, 0xFE2F}, {0xE0100, 0xE01EF}
+};
+
+// double width: CJK, hangul, fullwidth forms, emoji
+static const struct interval utf8_double_width[] = {
+    {0x1100, 0x115F}, {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF},
+    {0x4E00, 0x9FFF}, {0xA000, 0xA4CF}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+    {0xFE30, 0xFE4F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x1F300, 0x1F64F},
+    {0x1F900, 0x1F9FF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+int inIntervals(int cp, const struct interval *table, int n) {
+    int lo = 0, hi = n - 1;
+    if(cp < table[0].first || cp > table[n - 1].last)
+        return 0;
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if(cp > table[mid].last)
+            lo = mid + 1;
+        else if(cp < table[mid].first)
+            hi = mid - 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+int utf8Width(int cp) {
+    if(inIntervals(cp, utf8_zero_width, sizeof(utf8_zero_width) / sizeof(utf8_zero_width[0])))
+        return 0;
+    if(inIntervals(cp, utf8_double_width, sizeof(utf8_double_width) / sizeof(utf8_double_width[0])))
+        return 2;
+    return 1;
+}
+
+// expected length of a sequence from its lead byte, 0 if it can't lead one
+int utf8SeqLen(unsigned char c) {
+    if(c < 0x80) return 1;
+    if(c >= 0xC2 && c <= 0xDF) return 2;
+    if(c >= 0xE0 && c <= 0xEF) return 3;
+    if(c >= 0xF0 && c <= 0xF4) return 4;
+    return 0;
+}
+
+// Decodes one code point at s. Returns its length in bytes, or 0 if the
+// bytes are not well formed UTF-8 (overlong, surrogate, truncated...).
+int utf8Decode(const char *s, int len, int *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    int n = utf8SeqLen(u[0]);
+    if(n == 0 || n > len)
+        return 0;
+    if(n == 1) {
+        *cp = u[0];
+        return 1;
+    }
+    int c = u[0] & (0x7F >> n);
+    for(int i = 1; i < n; i++) {
+        if((u[i] & 0xC0) != 0x80)
+            return 0;
+        c = (c << 6) | (u[i] & 0x3F);
+    }
+    if((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)) ||
+       (c >= 0xD800 && c <= 0xDFFF))
+        return 0;
+    *cp = c;
+    return n;
+}
+
+#define UTF8_CONT(c) (((unsigned char)(c) & 0xC0) == 0x80)
+#define IS_CTRL(c) ((unsigned char)(c) < 0x20 || (c) == 0x7f)
+
+#ifdef __SSE2__
+// bit i set if byte i of v is a control byte, tabs included
+static inline int ctrlMask(__m128i v) {
+    __m128i low = _mm_and_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+                                _mm_cmpgt_epi8(v, _mm_set1_epi8(-1)));
+    return _mm_movemask_epi8(_mm_or_si128(low, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))));
+}
+#endif
+
+// Counts tabs and other control bytes in s and reports whether any byte is
+// outside ASCII, 16 bytes at a time where SSE2 is available.
+void editorScanBytes(const char *s, int len, int *tabs, int *ctrl, int *high) {
+    int t = 0, c = 0, h = 0, i = 0;
+#ifdef __SSE2__
+    const __m128i tab = _mm_set1_epi8('\t');
+    __m128i acc = _mm_setzero_si128();
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        acc = _mm_or_si128(acc, v);
+        int tm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+        t += __builtin_popcount(tm);
+        c += __builtin_popcount(ctrlMask(v) & ~tm);
+    }
+    h = _mm_movemask_epi8(acc) != 0;
+#endif
+    for(; i < len; i++) {
+        if(s[i] == '\t')
+            t++;
+        else if(IS_CTRL(s[i]))
+            c++;
+        if(s[i] & 0x80)
+            h = 1;
+    }
+    *tabs = t;
+    *ctrl = c;
+    *high = h;
+}
+
+// Stores the offsets of the control bytes in s into out.
+void editorScanControls(const char *s, int len, int *out) {
+    int n = 0, i = 0;
+#ifdef __SSE2__
+    for(; i + 16 <= len; i += 16) {
+        int m = ctrlMask(_mm_loadu_si128((const __m128i *)(s + i)));
+        while(m) {
+            out[n++] = i + __builtin_ctz(m);
+            m &= m - 1;
+        }
+    }
+#endif
+    for(; i < len; i++)
+        if(IS_CTRL(s[i]))
+            out[n++] = i;
+}
+
 /*** terminal ***/
 void die(char *s){
     // write(STDOUT_FILENO, "\x1b[2J",4);  
@@ -153,14 +841,48 @@ void die(char *s){
 }
 
 
-int editorReadKey(){
-    int nread;
-    char c;
-    while((nread = read(STDIN_FILENO, &c, 1)) != 1){
-        if(nread == -1 && errno != EAGAIN)
-            die("read");
+// Reads the rest of an SGR mouse report, "\x1b[<b;x;yM" for a press and
+// "...m" for a release, once "\x1b[<" has been read.
+int editorDecodeMouse(){
+    char buf[32];
+    unsigned int i = 0;
+    while(i < sizeof(buf) - 1){
+        if(read(STDIN_FILENO, &buf[i], 1) != 1)
+            return '\x1b';
+        if(buf[i] == 'M' || buf[i] == 'm')
+            break;
+        i++;
     }
+    if(i == sizeof(buf) - 1){
+        // too long for a report: skip to its end and ignore it
+        char c;
+        while(read(STDIN_FILENO, &c, 1) == 1 && c != 'M' && c != 'm')
+            ;
+        return MOUSE_EVENT;
+    }
+    char kind = buf[i];
+    buf[i] = '\0';
+    int b, x, y;
+    if(sscanf(buf, "%d;%d;%d", &b, &x, &y) != 3)
+        return MOUSE_EVENT;
+    // bits 2-4 are the modifiers, 5 is motion
+    if(b & 32)
+        return MOUSE_EVENT;
+    switch(b & ~(4 | 8 | 16)){
+        case 0:
+            if(kind == 'm')
+                return MOUSE_EVENT;
+            E.mouse_x = x - 1;
+            E.mouse_y = y - 1;
+            return MOUSE_CLICK;
+        case 64: return MOUSE_WHEEL_UP;
+        case 65: return MOUSE_WHEEL_DOWN;
+    }
+    return MOUSE_EVENT;
+}
 
+// turns the byte c, and any escape sequence it starts, into a key
+int editorDecodeKey(unsigned char c){
     if(c == '\x1b'){
         char seq[3];
         if(read(STDIN_FILENO, &seq[0], 1) != 1) 
@@ -169,6 +891,8 @@ int editorReadKey(){
             return '\x1b';
 
         if(seq[0] == '['){
+            if(seq[1] == '<')
+                return editorDecodeMouse();
             if(seq[1] >= '0' && seq[1] <= '9'){
                 if(read(STDIN_FILENO, &seq[2], 1) != 1)
                     return '\x1b';
@@ -207,6 +931,59 @@ int editorReadKey(){
     }
 }
 
+int editorReadKey(){
+    if(E.pending_key != -1) {
+        int key = E.pending_key;
+        E.pending_key = -1;
+        return key;
+    }
+    int nread;
+    unsigned char c;
+    while((nread = read(STDIN_FILENO, &c, 1)) != 1){
+        if(nread == -1 && errno != EAGAIN)
+            die("read");
+        if(nread == 0 && E.idle)
+            E.idle();
+    }
+
+    PROBE_BEGIN(PERF_INPUT);
+    int key = editorDecodeKey(c);
+    PROBE_END(PERF_INPUT);
+    return key;
+}
+
+
+// Returns the net number of wheel notches, down counting as positive, of
+// the wheel key and of any wheel events already queued behind it. The
+// first other key read is kept for the next editorReadKey.
+int editorReadWheel(int key){
+    int n = key == MOUSE_WHEEL_DOWN ? 1 : -1;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    while(poll(&pfd, 1, 0) == 1){
+        key = editorReadKey();
+        if(key == MOUSE_WHEEL_DOWN)
+            n++;
+        else if(key == MOUSE_WHEEL_UP)
+            n--;
+        else {
+            E.pending_key = key;
+            break;
+        }
+    }
+    return n;
+}
+
+// Reads the continuation bytes of a multi-byte character whose lead byte c
+// was returned by editorReadKey. Returns the number of bytes stored in buf.
+int editorReadUtf8(int c, char *buf) {
+    int n = utf8SeqLen(c);
+    int len = 1;
+    buf[0] = c;
+    while(len < n && read(STDIN_FILENO, &buf[len], 1) == 1)
+        len++;
+    return len;
+}
+
 
 int getCursorPosition(int *rows, int *cols){
     char buf[32];
@@ -248,130 +1025,680 @@ int getWindowSize(int *rows, int *cols){
     }
 }
 
+// screen columns left for the text
+int editorTextCols(){
+    return E.screencols - E.gutter;
+}
+
 /*** Syntax Highlighting ***/
 
 int is_separator(int c){
 	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row){
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
-	
-	if(E.syntax == NULL)
-		return;
+/*** syntax registry ***/
 
-	char **keywords = E.syntax->keywords;	
+// Syntax definitions are registered at startup from *.syn files, but only
+// their 'filetype' and 'match' lines are read then. The rest of a file is
+// parsed and compiled into lookup tables the first time a buffer of that
+// type is opened.
 
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;	
+struct syntaxSlot {
+    char *key;      // ".ext" or an exact basename
+    struct editorSyntax *syntax;
+};
 
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
-	
-	int prev_sep = 1;
-	int in_string = 0;
-	int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
-	
-	int i = 0;
-	while(i < row->rsize){
-		char c = row->render[i];
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;		
+struct syntaxDB {
+    struct syntaxSlot *slots;
+    int cap;
+    int used;
+};
 
-		if(scs_len && !in_string && !in_comment){
-			if(!strncmp(&row->render[i], scs, scs_len)){
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
-		}
-		
-		if (mcs_len && mce_len && !in_string) {
-      		if (in_comment) {
-        		row->hl[i] = HL_MLCOMMENT;
-        		if (!strncmp(&row->render[i], mce, mce_len)) {
-          			memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          			i += mce_len;
-          			in_comment = 0;
-          			prev_sep = 1;
-          			continue;
-        		} else {
-         		 	i++;
-          			continue;
-        		}
-      		} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-       			memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        		i += mcs_len;
-        		in_comment = 1;
-        		continue;
-      		}
-    	}
-		
+struct syntaxDB SYNTAXDB;
 
-		if(E.syntax->flags & HL_HIGHLIGHT_STRINGS){
-			if(in_string){
-				row->hl[i]	= HL_STRING;
-				if(c == '\\' && i + 1 < row->rsize){
-					row->hl[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if(c == in_string)
-					in_string = 0;
-				i++;
-				prev_sep = 1;
-				continue;
-			}else{
-				if(c == '"' || c == '\'') {
-					in_string = c;
-					row->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
-			}
-		}
-		
-		if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-		  	  (c == '.' && prev_hl == HL_NUMBER)){
-				row->hl[i] = HL_NUMBER;
-				i++;
-				prev_sep = 0;
-				continue;
-			}
-		}
-		
-		if (prev_sep) {
-     		int j;
-      		for (j = 0; keywords[j]; j++) {
-       			int klen = strlen(keywords[j]);
-        		int kw2 = keywords[j][klen - 1] == '|';
-        		if (kw2)
-					 klen--;
-        		if (!strncmp(&row->render[i], keywords[j], klen) &&
-            		is_separator(row->render[i + klen])) {
-          				memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          				i += klen;
-          				break;
-        		}
-      		}
-      		if (keywords[j] != NULL) {
-        		prev_sep = 0;
-        		continue;
-      		}
-    	}
-		prev_sep = is_separator(c);
-		i++;	
-	}
-	
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if(changed && row->idx + 1 < E.numrows)
-		editorUpdateSyntax(&E.row[row->idx + 1]);
+unsigned int syntaxHash(const char *key) {
+    unsigned int h = 2166136261u;
+    while(*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
 }
 
-int editorSyntaxToColor(int hl) {
+void syntaxRegisterKey(const char *key, struct editorSyntax *s);
+
+void syntaxGrow() {
+    struct syntaxSlot *old = SYNTAXDB.slots;
+    int oldcap = SYNTAXDB.cap;
+    SYNTAXDB.cap = oldcap ? oldcap * 2 : 64;
+    SYNTAXDB.slots = calloc(SYNTAXDB.cap, sizeof(struct syntaxSlot));
+    SYNTAXDB.used = 0;
+    for(int i = 0; i < oldcap; i++) {
+        if(old[i].key) {
+            syntaxRegisterKey(old[i].key, old[i].syntax);
+            free(old[i].key);
+        }
+    }
+    free(old);
+}
+
+// later registrations replace earlier ones, so user files override built-ins
+void syntaxRegisterKey(const char *key, struct editorSyntax *s) {
+    if((SYNTAXDB.used + 1) * 2 > SYNTAXDB.cap)
+        syntaxGrow();
+    unsigned int i = syntaxHash(key) & (SYNTAXDB.cap - 1);
+    while(SYNTAXDB.slots[i].key && strcmp(SYNTAXDB.slots[i].key, key))
+        i = (i + 1) & (SYNTAXDB.cap - 1);
+    if(SYNTAXDB.slots[i].key == NULL) {
+        SYNTAXDB.slots[i].key = strdup(key);
+        SYNTAXDB.used++;
+    }
+    SYNTAXDB.slots[i].syntax = s;
+}
+
+void syntaxRegister(struct editorSyntax *s) {
+    for(int i = 0; s->filematch[i]; i++)
+        syntaxRegisterKey(s->filematch[i], s);
+}
+
+struct editorSyntax *syntaxLookup(const char *key) {
+    if(SYNTAXDB.cap == 0)
+        return NULL;
+    unsigned int i = syntaxHash(key) & (SYNTAXDB.cap - 1);
+    while(SYNTAXDB.slots[i].key) {
+        if(!strcmp(SYNTAXDB.slots[i].key, key))
+            return SYNTAXDB.slots[i].syntax;
+        i = (i + 1) & (SYNTAXDB.cap - 1);
+    }
+    return NULL;
+}
+
+// appends to a NULL terminated list of strings
+char **syntaxListAdd(char **list, const char *word, const char *suffix) {
+    int n = 0;
+    while(list && list[n])
+        n++;
+    list = realloc(list, sizeof(char *) * (n + 2));
+    list[n] = malloc(strlen(word) + strlen(suffix) + 1);
+    strcpy(list[n], word);
+    strcat(list[n], suffix);
+    list[n + 1] = NULL;
+    return list;
+}
+
+#define SYNTAX_DELIMS " \t\r\n"
+
+// Reads a definition file. With header_only set, reading stops at the first
+// line that is not 'filetype', 'match', a comment or blank.
+int syntaxParseFile(struct editorSyntax *s, int header_only) {
+    FILE *fp = fopen(s->path, "r");
+    if(!fp)
+        return -1;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    while(getline(&line, &linecap, fp) != -1) {
+        char *save;
+        char *directive = strtok_r(line, SYNTAX_DELIMS, &save);
+        if(directive == NULL || directive[0] == '#')
+            continue;
+
+        char *arg;
+        if(!strcmp(directive, "filetype")) {
+            if((arg = strtok_r(NULL, SYNTAX_DELIMS, &save)) && !s->filetype)
+                s->filetype = strdup(arg);
+        } else if(!strcmp(directive, "match")) {
+            if(!header_only)
+                continue;
+            while((arg = strtok_r(NULL, SYNTAX_DELIMS, &save)))
+                s->filematch = syntaxListAdd(s->filematch, arg, "");
+        } else if(header_only) {
+            break;
+        } else if(!strcmp(directive, "keywords") || !strcmp(directive, "types")) {
+            const char *suffix = directive[0] == 't' ? "|" : "";
+            while((arg = strtok_r(NULL, SYNTAX_DELIMS, &save)))
+                s->keywords = syntaxListAdd(s->keywords, arg, suffix);
+        } else if(!strcmp(directive, "comment")) {
+            if((arg = strtok_r(NULL, SYNTAX_DELIMS, &save)))
+                s->singleline_comment_start = strdup(arg);
+        } else if(!strcmp(directive, "multiline")) {
+            char *end;
+            if((arg = strtok_r(NULL, SYNTAX_DELIMS, &save)) &&
+               (end = strtok_r(NULL, SYNTAX_DELIMS, &save))) {
+                s->multiline_comment_start = strdup(arg);
+                s->multiline_comment_end = strdup(end);
+            }
+        } else if(!strcmp(directive, "quotes")) {
+            if((arg = strtok_r(NULL, SYNTAX_DELIMS, &save)))
+                s->quotes = strdup(arg);
+        } else if(!strcmp(directive, "separators")) {
+            if((arg = strtok_r(NULL, SYNTAX_DELIMS, &save)))
+                s->separators = strdup(arg);
+        } else if(!strcmp(directive, "highlight")) {
+            while((arg = strtok_r(NULL, SYNTAX_DELIMS, &save))) {
+                if(!strcmp(arg, "numbers"))
+                    s->flags |= HL_HIGHLIGHT_NUMBERS;
+                else if(!strcmp(arg, "strings"))
+                    s->flags |= HL_HIGHLIGHT_STRINGS;
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+void syntaxAddKeyword(struct editorSyntax *s, const char *kw, int len, int type) {
+    int node = -1;
+    for(int i = 0; i < len; i++) {
+        unsigned char c = kw[i];
+        int n = (i == 0) ? s->kwroot[c] : s->kwtrie[node].child;
+        while(n != -1 && s->kwtrie[n].c != c)
+            n = s->kwtrie[n].next;
+        if(n == -1) {
+            s->kwtrie = realloc(s->kwtrie, sizeof(struct kwnode) * (s->kwnodes + 1));
+            n = s->kwnodes++;
+            s->kwtrie[n].c = c;
+            s->kwtrie[n].type = 0;
+            s->kwtrie[n].child = -1;
+            if(i == 0) {
+                s->kwtrie[n].next = -1;
+                s->kwroot[c] = n;
+            } else {
+                s->kwtrie[n].next = s->kwtrie[node].child;
+                s->kwtrie[node].child = n;
+            }
+        }
+        node = n;
+    }
+    if(node != -1)
+        s->kwtrie[node].type = type;
+}
+
+// Builds the separator and quote tables and the keyword trie. Entries from
+// files have their body parsed here, on first use.
+pthread_mutex_t syntax_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void syntaxCompile(struct editorSyntax *s) {
+    pthread_mutex_lock(&syntax_lock);
+    if(s->compiled) {
+        pthread_mutex_unlock(&syntax_lock);
+        return;
+    }
+    if(s->path)
+        syntaxParseFile(s, 0);
+
+    for(int c = 0; c < 256; c++) {
+        s->sep[c] = s->separators ? (isspace(c) || c == '\0' || (c && strchr(s->separators, c)))
+                                  : is_separator(c);
+        s->quote[c] = 0;
+        s->kwroot[c] = -1;
+    }
+    for(const char *q = s->quotes ? s->quotes : "\"'"; *q; q++)
+        s->quote[(unsigned char)*q] = 1;
+
+    for(int j = 0; s->keywords && s->keywords[j]; j++) {
+        int klen = strlen(s->keywords[j]);
+        int kw2 = klen && s->keywords[j][klen - 1] == '|';
+        syntaxAddKeyword(s, s->keywords[j], klen - kw2, kw2 ? HL_KEYWORD2 : HL_KEYWORD1);
+    }
+    s->compiled = 1;
+    pthread_mutex_unlock(&syntax_lock);
+}
+
+// Returns the highlight of the keyword starting at text, if it is followed
+// by a separator, and stores its length in klen.
+int syntaxMatchKeyword(struct editorSyntax *s, const char *text, int len, int *klen) {
+    int n = s->kwroot[(unsigned char)text[0]];
+    int i = 1;
+    while(n != -1) {
+        if(s->kwtrie[n].type && (i == len || s->sep[(unsigned char)text[i]])) {
+            *klen = i;
+            return s->kwtrie[n].type;
+        }
+        if(i == len)
+            break;
+        unsigned char c = text[i++];
+        n = s->kwtrie[n].child;
+        while(n != -1 && s->kwtrie[n].c != c)
+            n = s->kwtrie[n].next;
+    }
+    return 0;
+}
+
+void syntaxLoadDir(const char *dir) {
+    DIR *d = opendir(dir);
+    if(d == NULL)
+        return;
+    struct dirent *ent;
+    while((ent = readdir(d)) != NULL) {
+        int len = strlen(ent->d_name);
+        if(len < 5 || strcmp(&ent->d_name[len - 4], ".syn"))
+            continue;
+
+        struct editorSyntax *s = calloc(1, sizeof(struct editorSyntax));
+        s->path = malloc(strlen(dir) + len + 2);
+        sprintf(s->path, "%s/%s", dir, ent->d_name);
+        if(syntaxParseFile(s, 1) == -1 || s->filetype == NULL || s->filematch == NULL) {
+            free(s->path);
+            free(s->filetype);
+            free(s);
+            continue;
+        }
+        syntaxRegister(s);
+    }
+    closedir(d);
+}
+
+void editorLoadSyntaxes() {
+    for(unsigned int j = 0; j < HLDB_ENTRIES; j++)
+        syntaxRegister(&HLDB[j]);
+
+    syntaxLoadDir(TEDIT_SYNTAX_DIR);
+
+    char *home = getenv("HOME");
+    if(home) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/.config/tedit/syntax", home);
+        syntaxLoadDir(path);
+    }
+    char *dir = getenv("TEDIT_SYNTAX_DIR");
+    if(dir)
+        syntaxLoadDir(dir);
+}
+
+
+// Longest comment delimiter minus one: how far a delimiter that ends at a
+// given offset can reach back.
+int editorSyntaxReach() {
+	struct editorSyntax *s = E.syntax;
+	int reach = 1;
+	char *delims[] = {s->singleline_comment_start, s->multiline_comment_start,
+	                  s->multiline_comment_end};
+	for(int j = 0; j < 3; j++) {
+		int len = delims[j] ? (int)strlen(delims[j]) : 0;
+		if(len > reach)
+			reach = len;
+	}
+	return reach - 1;
+}
+
+// Highlighting is kept per row as runs of render bytes of one class. A run
+// is a byte holding the class in its high nibble and the length in its low
+// one; runs of 16 bytes or more have a low nibble of 0 and the length
+// follows in LEB128. A row's runs are expanded to one class per byte only
+// to highlight or shift it.
+
+// Per-thread buffer for the expanded form.
+_Thread_local unsigned char *hl_scratch = NULL;
+_Thread_local int hl_scratch_cap = 0;
+
+unsigned char *hlScratch(int size) {
+    if(size > hl_scratch_cap) {
+        hl_scratch_cap = size > 2 * hl_scratch_cap ? size : 2 * hl_scratch_cap;
+        hl_scratch = realloc(hl_scratch, hl_scratch_cap);
+    }
+    return hl_scratch;
+}
+
+void hlScratchFree() {
+    free(hl_scratch);
+    hl_scratch = NULL;
+    hl_scratch_cap = 0;
+}
+
+// Decodes the run at *p and moves past it; returns its length.
+int hlNextRun(const unsigned char **p, int *cls) {
+    const unsigned char *q = *p;
+    *cls = *q >> 4;
+    int len = *q++ & 0x0F;
+    if(len == 0) {
+        int shift = 0;
+        do {
+            len |= (*q & 0x7F) << shift;
+            shift += 7;
+        } while(*q++ & 0x80);
+    }
+    *p = q;
+    return len;
+}
+
+// Writes the row's highlighting, one class per render byte, into hl.
+void hlExpand(erow *row, unsigned char *hl) {
+    const unsigned char *p = row->hl, *end = row->hl + row->hllen;
+    int at = 0, cls;
+    while(p < end) {
+        int len = hlNextRun(&p, &cls);
+        memset(&hl[at], cls, len);
+        at += len;
+    }
+}
+
+// Replaces the row's runs with the encoding of hl[0 .. row->rsize).
+void hlStore(erow *row, const unsigned char *hl) {
+    // no run takes more bytes than it covers
+    unsigned char *out = malloc(row->rsize + 1);
+    int n = 0;
+    for(int i = 0; i < row->rsize; ) {
+        int start = i;
+        while(i < row->rsize && hl[i] == hl[start])
+            i++;
+        int len = i - start;
+        if(len < 16) {
+            out[n++] = hl[start] << 4 | len;
+        } else {
+            out[n++] = hl[start] << 4;
+            while(len >= 0x80) {
+                out[n++] = (len & 0x7F) | 0x80;
+                len >>= 7;
+            }
+            out[n++] = len;
+        }
+    }
+    free(row->hl);
+    row->hl = realloc(out, n ? n : 1);
+    row->hllen = n;
+}
+
+// Finds an offset at or before 'at' where highlighting of an edited row can
+// restart in the tokenizer's initial state: the start of the row or right
+// after a plain separator, far enough back that no delimiter reads past 'at'.
+int editorSyntaxRestart(erow *row, const unsigned char *hl, int at) {
+	if(E.syntax == NULL)
+		return at;
+	int p = at - editorSyntaxReach();
+	if(p < 0)
+		p = 0;
+	while(p > 0 && !(hl[p - 1] == HL_NORMAL &&
+	                 E.syntax->sep[(unsigned char)row->render[p - 1]]))
+		p--;
+	return p;
+}
+
+// Highlights row->render from offset 'from' (0 or a point returned by
+// editorSyntaxRestart) into hl, one class per byte. hl must already be
+// sized to rsize; entries from 'stable' on are expected to hold the
+// highlighting from before the edit,
+// shifted along with the text, and the pass stops as soon as it reaches a
+// plain separator there, since from that point on the old result holds.
+// *state is the open comment state on entry and on return. Touches neither
+// E nor the row's own state, so it's safe off the main thread. Returns the
+// number of bytes highlighted.
+int syntaxHighlight(struct editorSyntax *syntax, erow *row, unsigned char *hl, int from, int stable, int *state){
+	if(syntax == NULL) {
+		int end = stable < row->rsize ? stable : row->rsize;
+		memset(&hl[from], HL_NORMAL, end - from);
+		*state = 0;
+		return end - from;
+	}
+
+	char *scs = syntax->singleline_comment_start;
+	char *mcs = syntax->multiline_comment_start;
+	char *mce = syntax->multiline_comment_end;	
+
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
+	
+	int prev_sep = 1;
+	int in_string = 0;
+	int in_comment = *state;
+	
+	int i = from;
+	while(i < row->rsize){
+		unsigned char c = row->render[i];
+		unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;		
+
+		if(scs_len && !in_string && !in_comment && c == (unsigned char)scs[0]){
+			if(!strncmp(&row->render[i], scs, scs_len)){
+				memset(&hl[i], HL_COMMENT, row->rsize - i);
+				i = row->rsize;
+				break;
+			}
+		}
+		
+		if (mcs_len && mce_len && !in_string) {
+      		if (in_comment) {
+        		hl[i] = HL_MLCOMMENT;
+        		if (!strncmp(&row->render[i], mce, mce_len)) {
+          			memset(&hl[i], HL_MLCOMMENT, mce_len);
+          			i += mce_len;
+          			in_comment = 0;
+          			prev_sep = 1;
+          			continue;
+        		} else {
+         		 	i++;
+          			continue;
+        		}
+      		} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+       			memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        		i += mcs_len;
+        		in_comment = 1;
+        		continue;
+      		}
+    	}
+		
+
+		if(syntax->flags & HL_HIGHLIGHT_STRINGS){
+			if(in_string){
+				hl[i]	= HL_STRING;
+				if(c == '\\' && i + 1 < row->rsize){
+					hl[i + 1] = HL_STRING;
+					i += 2;
+					continue;
+				}
+				if(c == in_string)
+					in_string = 0;
+				i++;
+				prev_sep = 1;
+				continue;
+			}else{
+				if(syntax->quote[c]) {
+					in_string = c;
+					hl[i] = HL_STRING;
+					i++;
+					continue;
+				}
+			}
+		}
+		
+		if(syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+			if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+		  	  (c == '.' && prev_hl == HL_NUMBER)){
+				hl[i] = HL_NUMBER;
+				i++;
+				prev_sep = 0;
+				continue;
+			}
+		}
+		
+		if (prev_sep) {
+     		int klen;
+      		int type = syntaxMatchKeyword(syntax, &row->render[i], row->rsize - i, &klen);
+      		if (type) {
+          		memset(&hl[i], type, klen);
+          		i += klen;
+        		prev_sep = 0;
+        		continue;
+      		}
+    	}
+		prev_sep = syntax->sep[c];
+		if(prev_sep && i >= stable && hl[i] == HL_NORMAL) {
+			*state = row->hl_open_comment;
+			return i - from;
+		}
+		hl[i] = HL_NORMAL;
+		i++;	
+	}
+	*state = in_comment;
+	return i - from;
+}
+
+// syntaxHighlight for a row of the buffer, entering in the previous row's
+// open comment state, after which hl is stored as the row's runs. Returns 1
+// if the row's own state changed.
+int editorHighlightFrom(erow *row, unsigned char *hl, int from, int stable){
+	PERF_COUNT(rows_highlighted, 1);
+	int state = (from == 0 && row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+	E.stats.highlighted += syntaxHighlight(E.syntax, row, hl, from, stable, &state);
+	hlStore(row, hl);
+	wordsIndexRow(row, hl);
+	int changed = (row->hl_open_comment != state);
+	row->hl_open_comment = state;
+	return changed;
+}
+
+// Highlights a whole row, then the rows after it for as long as their
+// open comment state keeps changing.
+void editorUpdateSyntax(erow *row){
+	PROBE_BEGIN(PERF_SYNTAX);
+	int changed = editorHighlightFrom(row, hlScratch(row->rsize), 0, row->rsize + 1);
+	while(changed && row->idx + 1 < E.numrows) {
+		row = &E.row[row->idx + 1];
+		changed = editorHighlightFrom(row, hlScratch(row->rsize), 0, row->rsize + 1);
+	}
+	PROBE_END(PERF_SYNTAX);
+}
+
+// Highlighting many rows at once (opening a file, picking a syntax) is
+// split into chunks highlighted on worker threads. Only the first chunk
+// knows the open comment state it starts in, so each of the others is
+// highlighted assuming it starts outside a comment, and its first rows are
+// highlighted a second time assuming it starts inside one, until that
+// guess ends a row in the same state as the first pass; from there on the
+// two agree. A sequential pass then walks the chunks, keeping whichever
+// result matches the state the previous chunk actually ended in.
+#define HL_CHUNK_ROWS 4096  // fewest rows worth a thread of their own
+#define HL_SPEC_ROWS 1024   // how far the in-comment guess is followed
+
+struct hlChunk {
+    struct editorSyntax *syntax;
+    erow *rows;
+    int n;
+    unsigned char **spec_hl;    // in-comment guess, the runs of each row
+    int *spec_hllen;
+    int *spec_open;
+    int spec_n;                 // rows covered by the guess
+    int spec_done;              // guess rejoined the first pass, or covers all rows
+    long long highlighted;
+};
+
+void *hlChunkWorker(void *arg) {
+    struct hlChunk *c = arg;
+    int state = 0;
+    for(int k = 0; k < c->n; k++) {
+        erow *row = &c->rows[k];
+        unsigned char *hl = hlScratch(row->rsize);
+        c->highlighted += syntaxHighlight(c->syntax, row, hl, 0, row->rsize + 1, &state);
+        hlStore(row, hl);
+        row->hl_open_comment = state;
+    }
+
+    state = 1;
+    for(int k = 0; k < c->n && k < HL_SPEC_ROWS; k++) {
+        erow guess = c->rows[k];
+        unsigned char *hl = hlScratch(guess.rsize);
+        c->highlighted += syntaxHighlight(c->syntax, &guess, hl, 0, guess.rsize + 1, &state);
+        guess.hl = NULL;
+        hlStore(&guess, hl);
+        c->spec_hl[k] = guess.hl;
+        c->spec_hllen[k] = guess.hllen;
+        c->spec_open[k] = state;
+        c->spec_n = k + 1;
+        if(state == c->rows[k].hl_open_comment)
+            break;
+    }
+    c->spec_done = (c->spec_n == c->n ||
+                    c->spec_open[c->spec_n - 1] == c->rows[c->spec_n - 1].hl_open_comment);
+    hlScratchFree();
+    return NULL;
+}
+
+// Highlights rows at .. at + n - 1.
+void editorHighlightRows(int at, int n) {
+    static long cpus = 0;
+    if(cpus == 0)
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nchunks = n / HL_CHUNK_ROWS;
+    if(nchunks > cpus)
+        nchunks = cpus;
+
+    PROBE_BEGIN(PERF_SYNTAX);
+    if(E.syntax == NULL || E.syntax->multiline_comment_start == NULL || nchunks < 2) {
+        // no state carries over between rows, or too few rows to split
+        for(int k = 0; k < n; k++) {
+            erow *row = &E.row[at + k];
+            editorHighlightFrom(row, hlScratch(row->rsize), 0, row->rsize + 1);
+        }
+        PROBE_END(PERF_SYNTAX);
+        return;
+    }
+
+    struct hlChunk *chunks = calloc(nchunks, sizeof(struct hlChunk));
+    struct worker *tids = malloc(sizeof(struct worker) * nchunks);
+    for(int i = 0; i < nchunks; i++) {
+        struct hlChunk *c = &chunks[i];
+        int start = at + (long long)n * i / nchunks;
+        c->syntax = E.syntax;
+        c->rows = &E.row[start];
+        c->n = at + (long long)n * (i + 1) / nchunks - start;
+        if(i == 0)
+            continue;
+        c->spec_hl = calloc(HL_SPEC_ROWS, sizeof(unsigned char *));
+        c->spec_hllen = malloc(sizeof(int) * HL_SPEC_ROWS);
+        c->spec_open = malloc(sizeof(int) * HL_SPEC_ROWS);
+        workerStart(&tids[i], hlChunkWorker, c);
+    }
+
+    // the first chunk follows the row before it, as usual
+    for(int k = 0; k < chunks[0].n; k++) {
+        erow *row = &chunks[0].rows[k];
+        editorHighlightFrom(row, hlScratch(row->rsize), 0, row->rsize + 1);
+    }
+
+    for(int i = 1; i < nchunks; i++) {
+        struct hlChunk *c = &chunks[i];
+        workerJoin(&tids[i]);
+        E.stats.highlighted += c->highlighted;
+        PERF_COUNT(rows_highlighted, c->n);
+
+        if(c->rows[-1].hl_open_comment) {
+            for(int k = 0; k < c->spec_n; k++) {
+                free(c->rows[k].hl);
+                c->rows[k].hl = c->spec_hl[k];
+                c->rows[k].hllen = c->spec_hllen[k];
+                c->rows[k].hl_open_comment = c->spec_open[k];
+                c->spec_hl[k] = NULL;
+            }
+            // the guess gave up before rejoining: carry on row by row
+            if(!c->spec_done) {
+                int changed = 1;
+                for(int k = c->spec_n; changed && k < c->n; k++)
+                    changed = editorHighlightFrom(&c->rows[k], hlScratch(c->rows[k].rsize),
+                                                  0, c->rows[k].rsize + 1);
+            }
+        }
+        for(int k = 0; k < c->spec_n; k++)
+            free(c->spec_hl[k]);
+        free(c->spec_hl);
+        free(c->spec_hllen);
+        free(c->spec_open);
+    }
+    // the workers can't touch the word index, so their rows join it here
+    if(E.words.built) {
+        for(int k = chunks[0].n; k < n; k++) {
+            erow *row = &E.row[at + k];
+            unsigned char *hl = hlScratch(row->rsize);
+            hlExpand(row, hl);
+            wordsIndexRow(row, hl);
+        }
+    }
+    free(tids);
+    free(chunks);
+    PROBE_END(PERF_SYNTAX);
+}
+
+int editorSyntaxToColor(int hl) {
 	switch(hl) {
 		case HL_COMMENT:
 		case HL_MLCOMMENT: return 36;     // cyan
@@ -386,32 +1713,29 @@ int editorSyntaxToColor(int hl) {
 
 void editorSelectSyntaxHighlight() {
 	E.syntax = NULL;
-	if(E.filename == NULL)
+	if(E.filename == NULL || E.headless)
 		return;
 
-	char *ext = strchr(E.filename, '.');
-
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct editorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-    	while (s->filematch[i]) {
-     		int is_ext = (s->filematch[i][0] == '.');
-      		if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          		(!is_ext && strstr(E.filename, s->filematch[i]))) {
-        		E.syntax = s;
-				
-				int filerow;
-				for(filerow = 0; filerow < E.numrows; filerow++){
-					editorUpdateSyntax(&E.row[filerow]);
-				}
-        		return;
-      		}
-      		i++;
-    	}
-  	}
+	// exact basenames (Makefile) take precedence over the extension
+	char *base = strrchr(E.filename, '/');
+	base = base ? base + 1 : E.filename;
+	struct editorSyntax *s = syntaxLookup(base);
+	if(s == NULL) {
+		char *ext = strrchr(base, '.');
+		if(ext)
+			s = syntaxLookup(ext);
+	}
+	if(s == NULL)
+		return;
+
+	syntaxCompile(s);
+	E.syntax = s;
+
+	editorHighlightRows(0, E.numrows);
 }
 
 void disableRawMode(){
+    write(STDOUT_FILENO, "\x1b[?1006l\x1b[?1000l", 16);
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -443,184 +1767,2381 @@ void enableRawMode(){
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &obj) == -1)
         die("tcsetattr");
 
+    // mouse button and wheel reports, in the SGR encoding
+    write(STDOUT_FILENO, "\x1b[?1000h\x1b[?1006h", 16);
 }
 
-/*** row operations ***/
+/*** line index ***/
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int i;
-    for(i = 0; i < cx; i++) {
-        if(row->chars[i] == '\t')
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-        rx++;
-    }
-    return rx;
+long long lineIndexValue(int i) {
+    E.row[i].isize = E.row[i].size;
+    return E.row[i].size + 1;
 }
 
-int editorRowRxToCx(erow *row, int rx){
-	int cur_rx = 0;
-	int cx;
-	for(cx = 0; cx < row->size; cx++){
-		if (row->chars[cx] == '\t')
-			cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-		cur_rx++;
-
-		if (cur_rx > rx)
-			return cx;
-	}
-	return cx;
+struct rowIndex *editorLineIndex() {
+    if(E.lineidx.stale || E.lineidx.n != E.numrows)
+        rowIndexBuild(&E.lineidx, E.numrows, lineIndexValue);
+    return &E.lineidx;
+}
 
+// byte offset of the start of row 'at' in the saved file
+long long editorRowOffset(int at) {
+    return rowIndexPrefix(editorLineIndex(), at);
 }
-void editorUpdateRow(erow *row){
-    int tabs = 0;
-    int i;
-    for(i = 0; i < row->size ; i++)
-        if(row->chars[i] == '\t')
-            tabs++;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+// row containing byte offset 'offset'
+int editorOffsetToRow(long long offset) {
+    return rowIndexSearch(editorLineIndex(), offset);
+}
 
-    int index = 0;
-    for(i = 0; i < row->size; i++) {
-        if(row->chars[i] == '\t') {
-            row->render[index++] = ' ';
-            while(index % TAB_STOP != 0)
-                row->render[index++] = ' ';
-        } else {
-            row->render[index++] = row->chars[i];
+/*** soft wrap ***/
+
+// With wrapping on (Ctrl-W), rows wider than the screen are cut into
+// visual lines. A row's breaks are worked out once per screen width and
+// kept until the row changes; E.wrapidx holds the number of visual lines
+// of each row, so rows and visual lines convert in log time however long
+// the rows are.
+
+// Lays the row out for the current width if needed; returns its number of
+// visual lines. Rows whose render is their text break every editorTextCols()
+// bytes and keep no table; otherwise a character, tabs included, is never
+// split across lines.
+int editorRowWrapLines(erow *row) {
+    int width = editorTextCols();
+    if(row->wrapw == width)
+        return row->nwraps;
+    free(row->wraps);
+    row->wraps = NULL;
+    row->wrapw = width;
+    if(row->rmap == NULL) {
+        row->nwraps = row->rsize > width ? (row->rsize + width - 1) / width : 1;
+        return row->nwraps;
+    }
+
+    int n = 1, cap = 0;
+    int linecol = 0;
+    int cx = 0;
+    while(cx < row->size) {
+        int r = row->rmap[cx];
+        while(cx < row->size && row->rmap[cx] == r)
+            cx++;
+        int col = row->rcol ? row->rcol[r] : r;
+        int next = row->rcol ? row->rcol[row->rmap[cx]] : row->rmap[cx];
+        // a character that doesn't fit moves to the next line whole
+        if(next > linecol + width && col > linecol) {
+            if(n >= cap) {
+                cap = cap ? cap * 2 : 8;
+                row->wraps = realloc(row->wraps, sizeof(int) * cap);
+            }
+            row->wraps[n++] = r;
+            linecol = col;
         }
     }
-    row->render[index] = '\0';
-    row->rsize = index;
-		
-	editorUpdateSyntax(row);
+    if(row->wraps)
+        row->wraps[0] = 0;
+    row->nwraps = n;
+    return n;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if(at < 0 || at > E.numrows)
-        return;
-    
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-	
-	for(int j = at + 1; j <= E.numrows; j++)
-		E.row[j].idx++;	
-
-	E.row[at].idx = at;
-
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
-    E.numrows++;
-    E.dirty++;
+// render offset where visual line k of the row starts
+int editorRowWrapStart(erow *row, int k) {
+    editorRowWrapLines(row);
+    if(k <= 0)
+        return 0;
+    if(row->wraps == NULL) {
+        int width = editorTextCols();
+        return k * width < row->rsize ? k * width : row->rsize;
+    }
+    return row->wraps[k];
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-	free(row->hl);
+// render offset where visual line k ends
+int editorRowWrapEnd(erow *row, int k) {
+    return k + 1 < editorRowWrapLines(row) ? editorRowWrapStart(row, k + 1) : row->rsize;
 }
 
-void editorDelRow(int at){
-    if(at < 0 || at >= E.numrows)
-        return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-	for(int j = at; j < E.numrows - 1; j++)
-		E.row[j].idx--;
-	    
-	E.numrows--;
-    E.dirty++;
+// visual line of the row holding render offset r; the end of the row
+// belongs to the last line
+int editorRowWrapLine(erow *row, int r) {
+    int n = editorRowWrapLines(row);
+    if(row->wraps == NULL) {
+        int k = r / editorTextCols();
+        return k < n ? k : n - 1;
+    }
+    int lo = 0, hi = n - 1;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(row->wraps[mid] <= r)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)  {
-    if(at < 0 || at > row->size)
-        at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+long long wrapIndexValue(int i) {
+    E.row[i].iwraps = editorRowWrapLines(&E.row[i]);
+    return E.row[i].iwraps;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+struct rowIndex *editorWrapIndex() {
+    if(E.wrapidx.stale || E.wrapidx.n != E.numrows || E.wrapidx_w != editorTextCols()) {
+        rowIndexBuild(&E.wrapidx, E.numrows, wrapIndexValue);
+        E.wrapidx_w = editorTextCols();
+    }
+    return &E.wrapidx;
 }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+// first visual line of row 'at'
+long long editorRowVline(int at) {
+    return rowIndexPrefix(editorWrapIndex(), at);
 }
 
-/*** editor operations ***/
+// row containing visual line v
+int editorVlineToRow(long long v) {
+    return rowIndexSearch(editorWrapIndex(), v);
+}
 
-void editorInsertChar(int c){
-    if(E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+// visual line of the cursor, and its column within that line
+long long editorWrapCursor(int *col) {
+    *col = 0;
+    if(E.cy >= E.numrows)
+        return editorRowVline(E.numrows);
+    erow *row = &E.row[E.cy];
+    int r = row->rmap ? row->rmap[E.cx] : E.cx;
+    int k = editorRowWrapLine(row, r);
+    int start = editorRowWrapStart(row, k);
+    *col = row->rcol ? row->rcol[r] - row->rcol[start] : r - start;
+    return editorRowVline(E.cy) + k;
 }
 
-void editorInsertNewline(){
-    if(E.cx == 0){
-        editorInsertRow(E.cy, "", 0);
+void editorToggleWrap() {
+    E.wrap = !E.wrap;
+    if(E.wrap) {
+        E.voff = editorRowVline(E.rowoff);
+        E.coloff = 0;
+    } else {
+        // nothing keeps the index up to date while wrapping is off
+        E.wrapidx.stale = 1;
+    }
+    editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
+/*** row text ***/
+
+// Row text lives in reference counted blocks so the clipboard can hold on
+// to rows, and paste can put them back, without copying. A block is never
+// changed while it is shared: writers go through textRealloc() or
+// textWritable(), which copy it first.
+struct textBlock {
+    int refs;
+    char data[];
+};
+
+#define TEXT_BLOCK(p) ((struct textBlock *)((p) - offsetof(struct textBlock, data)))
+
+char *textAlloc(size_t len) {
+    struct textBlock *b = malloc(sizeof(struct textBlock) + len + 1);
+    b->refs = 1;
+    return b->data;
+}
+
+char *textRetain(char *p) {
+    TEXT_BLOCK(p)->refs++;
+    return p;
+}
+
+void textRelease(char *p) {
+    if(p && --TEXT_BLOCK(p)->refs == 0)
+        free(TEXT_BLOCK(p));
+}
+
+// p holds len bytes plus a '\0'; returns a block only the caller refers to
+char *textWritable(char *p, size_t len) {
+    if(TEXT_BLOCK(p)->refs == 1)
+        return p;
+    char *copy = textAlloc(len);
+    memcpy(copy, p, len + 1);
+    textRelease(p);
+    return copy;
+}
+
+char *textRealloc(char *p, size_t len, size_t newlen) {
+    if(p == NULL)
+        return textAlloc(newlen);
+    if(TEXT_BLOCK(p)->refs > 1) {
+        char *copy = textAlloc(newlen);
+        memcpy(copy, p, (len < newlen ? len : newlen) + 1);
+        textRelease(p);
+        return copy;
+    }
+    return ((struct textBlock *)realloc(TEXT_BLOCK(p), sizeof(struct textBlock) + newlen + 1))->data;
+}
+
+/*** row operations ***/
+
+// keeps per-row indexes in step with a change to row->chars
+void editorRowChanged(erow *row) {
+    rowIndexAdd(&E.lineidx, row->idx, row->size - row->isize);
+    row->isize = row->size;
+    editorDiffEdit(row->idx, 1, 0);
+
+    row->wrapw = 0;
+    if(E.wrap && row->idx < E.wrapidx.n && !E.wrapidx.stale) {
+        int lines = editorRowWrapLines(row);
+        rowIndexAdd(&E.wrapidx, row->idx, lines - row->iwraps);
+        row->iwraps = lines;
+    }
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+    int r = row->rmap ? row->rmap[cx] : cx;
+    return row->rcol ? row->rcol[r] : r;
+}
+
+// chars offset of the character that contains render offset r
+int editorRowRToCx(erow *row, int r) {
+    if(row->rmap == NULL)
+        return r;
+    int lo = 0, hi = row->size;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(row->rmap[mid] <= r)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    while(lo > 0 && row->rmap[lo - 1] == row->rmap[lo])
+        lo--;
+    return lo;
+}
+
+// first render offset at or after screen column col
+int editorRowColToR(erow *row, int col) {
+    if(row->rcol == NULL)
+        return col < row->rsize ? col : row->rsize;
+    int lo = 0, hi = row->rsize;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(row->rcol[mid] < col)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // zero width marks belong to the character before them
+    while(lo < row->rsize) {
+        int n = utf8SeqLen(row->render[lo]);
+        if(n == 0 || row->rcol[lo + n] != row->rcol[lo])
+            break;
+        lo += n;
+    }
+    return lo;
+}
+
+int editorRowRxToCx(erow *row, int rx){
+    if(row->rcol == NULL)
+        return editorRowRToCx(row, rx < row->rsize ? rx : row->rsize);
+    if(rx >= row->rcol[row->rsize])
+        return row->size;
+    int lo = 0, hi = row->rsize;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(row->rcol[mid] <= rx)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    while(lo > 0 && row->rcol[lo - 1] == row->rcol[lo])
+        lo--;
+    return editorRowRToCx(row, lo);
+}
+
+// moves cx back to the first byte of the character it points into
+int editorRowSnapCx(erow *row, int cx) {
+    if(row->rmap == NULL)
+        return cx;
+    while(cx > 0 && cx < row->size && row->rmap[cx - 1] == row->rmap[cx])
+        cx--;
+    return cx;
+}
+
+// screen columns taken by the character at cx, for rows with a column map
+int editorRowCharWidth(erow *row, int cx) {
+    int r = row->rmap[cx];
+    return row->rcol[r + utf8SeqLen(row->render[r])] - row->rcol[r];
+}
+
+// Cursor steps move over a whole character together with any zero width
+// marks that follow it.
+int editorRowNextCx(erow *row, int cx) {
+    if(cx >= row->size)
+        return row->size;
+    if(row->rcol == NULL)
+        return cx + 1;
+    do {
+        int r = row->rmap[cx];
+        while(cx < row->size && row->rmap[cx] == r)
+            cx++;
+    } while(cx < row->size && editorRowCharWidth(row, cx) == 0);
+    return cx;
+}
+
+int editorRowPrevCx(erow *row, int cx) {
+    if(cx <= 0)
+        return 0;
+    if(row->rcol == NULL)
+        return cx - 1;
+    do {
+        cx = editorRowSnapCx(row, cx - 1);
+    } while(cx > 0 && editorRowCharWidth(row, cx) == 0);
+    return cx;
+}
+
+// rebuilds render and the offset maps from chars
+void editorRenderRow(erow *row){
+    int tabs, ctrl, high;
+    editorScanBytes(row->chars, row->size, &tabs, &ctrl, &high);
+
+    free(row->render);
+    free(row->rmap);
+    free(row->rcol);
+    free(row->ctrl);
+    row->rmap = NULL;
+    row->rcol = NULL;
+    row->ctrl = NULL;
+
+    int i;
+    int index = 0;
+    if(!high) {
+        // text between tabs is copied as is
+        row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+        if(tabs)
+            row->rmap = malloc(sizeof(int) * (row->size + 1));
+
+        if(!tabs) {
+            memcpy(row->render, row->chars, row->size);
+            index = row->size;
+        }
+        // otherwise 16 byte blocks without a tab are copied whole, and the
+        // rest byte by byte
+        i = index;
+        while(i < row->size) {
+            int stop = row->size;
+#ifdef __SSE2__
+            if(i + 16 <= row->size) {
+                __m128i v = _mm_loadu_si128((const __m128i *)&row->chars[i]);
+                if(!_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')))) {
+                    _mm_storeu_si128((__m128i *)&row->render[index], v);
+                    for(int k = 0; k < 16; k++)
+                        row->rmap[i + k] = index + k;
+                    i += 16;
+                    index += 16;
+                    continue;
+                }
+                stop = i + 16;
+            }
+#endif
+            for(; i < stop; i++) {
+                row->rmap[i] = index;
+                if(row->chars[i] == '\t') {
+                    row->render[index++] = ' ';
+                    while(index % TAB_STOP != 0)
+                        row->render[index++] = ' ';
+                } else {
+                    row->render[index++] = row->chars[i];
+                }
+            }
+        }
+        if(row->rmap)
+            row->rmap[row->size] = index;
+    } else {
+        // malformed bytes are rendered as U+FFFD, which takes 3 bytes
+        int cap = row->size * 3 + tabs * TAB_STOP + 1;
+        row->render = malloc(cap);
+        row->rmap = malloc(sizeof(int) * (row->size + 1));
+        row->rcol = malloc(sizeof(int) * cap);
+
+        int col = 0;
+        i = 0;
+        while(i < row->size) {
+            int cp;
+            int n = utf8Decode(&row->chars[i], row->size - i, &cp);
+            int start = index;
+            if(row->chars[i] == '\t') {
+                do {
+                    row->rcol[index] = col++;
+                    row->render[index++] = ' ';
+                } while(col % TAB_STOP != 0);
+            } else if(n == 0) {
+                memcpy(&row->render[index], "\xef\xbf\xbd", 3);
+                row->rcol[index] = row->rcol[index + 1] = row->rcol[index + 2] = col++;
+                index += 3;
+                n = 1;
+            } else {
+                for(int k = 0; k < n; k++) {
+                    row->rcol[index] = col;
+                    row->render[index++] = row->chars[i + k];
+                }
+                col += cp < 0x80 ? 1 : utf8Width(cp);
+            }
+            for(int k = 0; k < n; k++)
+                row->rmap[i + k] = start;
+            i += n;
+        }
+        row->rmap[row->size] = index;
+        row->rcol[index] = col;
+    }
+    row->render[index] = '\0';
+    row->rsize = index;
+    // tabs are spaces by now, so whatever control bytes are left are drawn
+    // as ^X
+    row->nctrl = ctrl;
+    if(ctrl) {
+        row->ctrl = malloc(sizeof(int) * ctrl);
+        editorScanControls(row->render, row->rsize, row->ctrl);
+    }
+    E.stats.rendered += index;
+    PERF_COUNT(allocs, 1 + (row->rmap != NULL) + (row->rcol != NULL) + (row->ctrl != NULL));
+
+    editorRowChanged(row);
+}
+
+void editorUpdateRow(erow *row){
+    editorRenderRow(row);
+	editorUpdateSyntax(row);
+}
+
+// An edit that doesn't involve tabs or non-ASCII text, in a row where
+// neither occurs, leaves render identical to chars. Such edits patch render
+// in place and re-highlight only around the edit.
+int editorRowIsPlain(erow *row, const char *s, size_t len) {
+    if(row->rmap || row->rcol || row->ctrl || row->render == NULL)
+        return 0;
+    for(size_t i = 0; i < len; i++)
+        if(IS_CTRL(s[i]) || (s[i] & 0x80))
+            return 0;
+    return 1;
+}
+
+void editorRowPatch(erow *row, int at, int removed, const char *s, int len) {
+    int tail = row->rsize - at - removed;
+    unsigned char *hl = hlScratch(row->rsize + len);
+    hlExpand(row, hl);
+    if(len > removed) {
+        row->render = realloc(row->render, row->rsize + len - removed + 1);
+        PERF_COUNT(allocs, 1);
+    }
+    memmove(&row->render[at + len], &row->render[at + removed], tail + 1);
+    memmove(&hl[at + len], &hl[at + removed], tail);
+    if(len)
+        memcpy(&row->render[at], s, len);
+    row->rsize += len - removed;
+    E.stats.rendered += len;
+
+    editorRowChanged(row);
+    PROBE_BEGIN(PERF_SYNTAX);
+    int changed = editorHighlightFrom(row, hl, editorSyntaxRestart(row, hl, at), at + len);
+    PROBE_END(PERF_SYNTAX);
+    if(changed && row->idx + 1 < E.numrows)
+        editorUpdateSyntax(&E.row[row->idx + 1]);
+}
+
+void editorFreeRow(erow *row) {
+    free(row->render);
+    free(row->rmap);
+    free(row->rcol);
+    free(row->ctrl);
+    free(row->wraps);
+    textRelease(row->chars);
+	free(row->hl);
+    wordsUnindexRow(row);
+}
+
+// Inserts n rows before row 'at' with a single shift of E.row, then
+// highlights them in one pass. Spans that are a whole text block are shared
+// with the new row instead of copied.
+void editorInsertRows(int at, struct textSpan *spans, int n) {
+    if(at < 0 || at > E.numrows || n <= 0)
+        return;
+    journalRows(at, spans, n);
+
+    if(E.numrows + n > E.rowcap) {
+        E.rowcap = E.rowcap * 2 > E.numrows + n ? E.rowcap * 2 : E.numrows + n;
+        E.row = realloc(E.row, sizeof(erow) * E.rowcap);
+    }
+    memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+    for(int j = at + n; j < E.numrows + n; j++)
+        E.row[j].idx += n;
+    E.numrows += n;
+    editorDiffEdit(at, 0, n);
+    // the new rows go in the indexes as 0 first; rendering each one then
+    // records its length and visual lines
+    rowIndexInsert(&E.lineidx, at, n, NULL);
+    rowIndexInsert(&E.wrapidx, at, n, NULL);
+
+    for(int k = 0; k < n; k++) {
+        erow *row = &E.row[at + k];
+        struct textSpan *sp = &spans[k];
+        row->idx = at + k;
+        row->size = sp->len;
+        if(sp->base && sp->s == sp->base && sp->s[sp->len] == '\0') {
+            row->chars = textRetain(sp->base);
+        } else {
+            row->chars = textAlloc(sp->len);
+            memcpy(row->chars, sp->s, sp->len);
+            row->chars[sp->len] = '\0';
+        }
+        row->isize = -1;
+        row->rsize = 0;
+        row->render = NULL;
+        row->rmap = NULL;
+        row->rcol = NULL;
+        row->ctrl = NULL;
+        row->nctrl = 0;
+        row->hl = NULL;
+        row->hllen = 0;
+        row->hl_open_comment = 0;
+        row->words = NULL;
+        row->nwords = 0;
+        row->wraps = NULL;
+        row->wrapw = 0;
+        row->iwraps = 0;
+        editorRenderRow(row);
+    }
+
+    editorHighlightRows(at, n);
+
+    // the row after the inserted ones used to follow row at - 1
+    int before = at > 0 ? E.row[at - 1].hl_open_comment : 0;
+    if(at + n < E.numrows && E.row[at + n - 1].hl_open_comment != before)
+        editorUpdateSyntax(&E.row[at + n]);
+    E.dirty++;
+}
+
+// Deletes n rows starting at 'at' with a single shift of E.row.
+void editorDelRows(int at, int n) {
+    if(at < 0 || at >= E.numrows || n <= 0)
+        return;
+    if(n > E.numrows - at)
+        n = E.numrows - at;
+    journalDelRows(at, n);
+
+    int before = at > 0 ? E.row[at - 1].hl_open_comment : 0;
+    int removed = E.row[at + n - 1].hl_open_comment;
+
+    for(int k = 0; k < n; k++)
+        editorFreeRow(&E.row[at + k]);
+    memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+    for(int j = at; j < E.numrows - n; j++)
+        E.row[j].idx -= n;
+    E.numrows -= n;
+    E.dirty++;
+    editorDiffEdit(at, n, -n);
+
+    rowIndexDelete(&E.lineidx, at, n);
+    rowIndexDelete(&E.wrapidx, at, n);
+
+    if(at < E.numrows && before != removed)
+        editorUpdateSyntax(&E.row[at]);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    struct textSpan span = {NULL, s, len};
+    editorInsertRows(at, &span, 1);
+}
+
+
+void editorDelRow(int at){
+    editorDelRows(at, 1);
+}
+
+void editorRowInsertString(erow *row, int at, char *s, size_t len) {
+    if(at < 0 || at > row->size)
+        at = row->size;
+    journalInsert(row->idx, at, s, len);
+    row->chars = textRealloc(row->chars, row->size, row->size + len);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    if(editorRowIsPlain(row, s, len))
+        editorRowPatch(row, at, 0, s, len);
+    else
+        editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c)  {
+    char ch = c;
+    editorRowInsertString(row, at, &ch, 1);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    journalInsert(row->idx, row->size, s, len);
+    row->chars = textRealloc(row->chars, row->size, row->size + len);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at, int len) {
+  if (at < 0 || at >= row->size) return;
+  if (len > row->size - at) len = row->size - at;
+  journalDelete(row->idx, at, len);
+  row->chars = textWritable(row->chars, row->size);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  if (editorRowIsPlain(row, NULL, 0))
+    editorRowPatch(row, at, len, NULL, 0);
+  else
+    editorUpdateRow(row);
+  E.dirty++;
+}
+
+// Replaces the whole text of the row with text, a textAlloc block of len
+// bytes plus a '\0' that the row takes over: one render and highlighting
+// pass however much changed.
+void editorRowSetText(erow *row, char *text, int len) {
+    journalDelete(row->idx, 0, row->size);
+    journalInsert(row->idx, 0, text, len);
+    textRelease(row->chars);
+    row->chars = text;
+    row->size = len;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+// chars offset of the first occurrence of query at or after 'from', or -1
+int editorRowFind(erow *row, int from, const char *query, int qlen) {
+    if(from > row->size)
+        return -1;
+    char *match = memmem(&row->chars[from], row->size - from, query, qlen);
+    return match ? match - row->chars : -1;
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c){
+    if(E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    if(c >= 0x80) {
+        char buf[4];
+        int len = editorReadUtf8(c, buf);
+        editorRowInsertString(&E.row[E.cy], E.cx, buf, len);
+        E.cx += len;
+        return;
+    }
+    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline(){
+    if(E.cx == 0){
+        editorInsertRow(E.cy, "", 0);
     } else {
         erow *row = &E.row[E.cy];
         editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
         row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        editorRowDelChar(row, E.cx, row->size - E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar() {
+  if (E.cy == E.numrows) 
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    int at = editorRowSnapCx(row, E.cx - 1);
+    editorRowDelChar(row, at, E.cx - at);
+    E.cx = at;
+  } else {
+        E.cx = E.row[E.cy - 1].size;
+        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+  }
+}
+
+/*** word completion ***/
+
+// Ctrl-N completes the word before the cursor from the words in the
+// buffer, the most frequent first; pressing it again cycles through the
+// other candidates and back to what was typed. The words are kept in a
+// trie with a count per word, and each node also records the highest
+// count below it, so the best candidates for a prefix are found without
+// looking at the rest of its subtree. The index is built the first time
+// it's needed; after that every row passing through the highlighter
+// replaces its own words in it (see editorHighlightFrom). Only words the
+// highlighter leaves plain or marks as keywords are counted.
+
+#define WORD_MIN 2
+#define WORD_MAX 64
+#define COMPLETE_MAX 16
+
+static inline int isWordChar(unsigned char c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// node for the word s, created along with any missing parents if create
+// is set; -1 if it isn't there
+int wordsNode(const char *s, int len, int create) {
+    struct wordIndex *w = &E.words;
+    int n = 0;
+    for(int i = 0; i < len; i++) {
+        int c = w->nodes[n].child;
+        while(c != -1 && w->nodes[c].c != (unsigned char)s[i])
+            c = w->nodes[c].next;
+        if(c == -1) {
+            if(!create)
+                return -1;
+            if(w->free != -1) {
+                c = w->free;
+                w->free = w->nodes[c].next;
+            } else {
+                if(w->n == w->cap) {
+                    w->cap *= 2;
+                    w->nodes = realloc(w->nodes, sizeof(struct wordNode) * w->cap);
+                }
+                c = w->n++;
+            }
+            w->nodes[c] = (struct wordNode){s[i], i + 1, n, -1, w->nodes[n].child, 0, 0, NULL};
+            w->nodes[n].child = c;
+        }
+        n = c;
+    }
+    return n;
+}
+
+unsigned long long wordsHash(const char *s, int len) {
+    unsigned long long h = 14695981039346656037ull;
+    for(int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Unlinks a node without a count or children and puts it on the free
+// list, dropping its word from the hash table.
+void wordsFree(int n) {
+    struct wordIndex *w = &E.words;
+    struct wordNode *node = &w->nodes[n];
+    int *link = &w->nodes[node->parent].child;
+    while(*link != n)
+        link = &w->nodes[*link].next;
+    *link = node->next;
+
+    if(node->word) {
+        int mask = w->nslot - 1;
+        int i = wordsHash(node->word, node->len) & mask;
+        while(w->slot[i].node != n + 1)
+            i = (i + 1) & mask;
+        // shift back the entries after it that probed past it
+        for(int j = (i + 1) & mask; w->slot[j].node; j = (j + 1) & mask) {
+            int home = w->slot[j].hash & mask;
+            if(((j - home) & mask) >= ((j - i) & mask)) {
+                w->slot[i] = w->slot[j];
+                i = j;
+            }
+        }
+        w->slot[i].node = 0;
+        w->nwords--;
+        free(node->word);
+        node->word = NULL;
+    }
+    node->next = w->free;
+    w->free = n;
+}
+
+// Node for the word s, through the hash table: once a word has been seen
+// this is a probe and a memcmp instead of a walk down the trie.
+int wordsLookup(const char *s, int len) {
+    struct wordIndex *w = &E.words;
+    unsigned long long h = wordsHash(s, len);
+    int i = h & (w->nslot - 1);
+    for(; w->slot[i].node; i = (i + 1) & (w->nslot - 1)) {
+        struct wordNode *n = &w->nodes[w->slot[i].node - 1];
+        if(w->slot[i].hash == h && n->len == len && !memcmp(n->word, s, len))
+            return w->slot[i].node - 1;
+    }
+
+    int n = wordsNode(s, len, 1);
+    w->nodes[n].word = malloc(len);
+    memcpy(w->nodes[n].word, s, len);
+    w->slot[i] = (struct wordSlot){h, n + 1};
+
+    // kept at most half full
+    if(++w->nwords * 2 > w->nslot) {
+        struct wordSlot *old = w->slot;
+        int nold = w->nslot;
+        w->nslot *= 2;
+        w->slot = calloc(w->nslot, sizeof(struct wordSlot));
+        for(int k = 0; k < nold; k++) {
+            if(!old[k].node)
+                continue;
+            int j = old[k].hash & (w->nslot - 1);
+            while(w->slot[j].node)
+                j = (j + 1) & (w->nslot - 1);
+            w->slot[j] = old[k];
+        }
+        free(old);
+    }
+    return n;
+}
+
+// Adds delta to the count of the word ending at node n and brings the
+// best counts of its ancestors up to date. Nodes left with no words at
+// or below them are freed, so prefixes typed on the way to a word don't
+// pile up.
+void wordsCount(int n, int delta) {
+    struct wordNode *nodes = E.words.nodes;
+    nodes[n].count += delta;
+    if(delta > 0) {
+        // a count going up can only raise the best ones above it
+        int count = nodes[n].count;
+        for(; n != -1 && nodes[n].best < count; n = nodes[n].parent)
+            nodes[n].best = count;
+        return;
+    }
+    while(n > 0 && nodes[n].count == 0 && nodes[n].child == -1) {
+        int parent = nodes[n].parent;
+        wordsFree(n);
+        n = parent;
+    }
+    for(; n != -1; n = nodes[n].parent) {
+        int best = nodes[n].count;
+        for(int c = nodes[n].child; c != -1; c = nodes[c].next)
+            if(nodes[c].best > best)
+                best = nodes[c].best;
+        if(best == nodes[n].best)
+            break;
+        nodes[n].best = best;
+    }
+}
+
+// Replaces the row's words in the index with those in its render, hl
+// being its highlighting.
+void wordsIndexRow(erow *row, const unsigned char *hl) {
+    if(!E.words.built)
+        return;
+    int *ids = NULL, n = 0, cap = 0;
+    for(int i = 0; i < row->rsize; ) {
+        if(!isWordChar(row->render[i])) {
+            i++;
+            continue;
+        }
+        int j = i;
+        while(j < row->rsize && isWordChar(row->render[j]))
+            j++;
+        if(j - i >= WORD_MIN && j - i <= WORD_MAX && !isdigit((unsigned char)row->render[i]) &&
+           (hl[i] == HL_NORMAL || hl[i] == HL_KEYWORD1 || hl[i] == HL_KEYWORD2)) {
+            if(n == cap) {
+                cap = cap ? cap * 2 : 8;
+                ids = realloc(ids, sizeof(int) * cap);
+            }
+            ids[n++] = wordsLookup(&row->render[i], j - i);
+        }
+        i = j;
+    }
+    // rows are re-highlighted for a change of comment state far more
+    // often than their words change
+    if(n == row->nwords && (n == 0 || !memcmp(ids, row->words, sizeof(int) * n))) {
+        free(ids);
+        return;
+    }
+    // counted before the old words go, so that nodes the new ones need
+    // aren't freed in between
+    for(int k = 0; k < n; k++)
+        wordsCount(ids[k], 1);
+    for(int k = 0; k < row->nwords; k++)
+        wordsCount(row->words[k], -1);
+    free(row->words);
+    row->words = ids;
+    row->nwords = n;
+}
+
+void wordsUnindexRow(erow *row) {
+    for(int k = 0; k < row->nwords; k++)
+        wordsCount(row->words[k], -1);
+    free(row->words);
+    row->words = NULL;
+    row->nwords = 0;
+}
+
+void wordsBuild() {
+    struct wordIndex *w = &E.words;
+    w->cap = 1024;
+    w->nodes = malloc(sizeof(struct wordNode) * w->cap);
+    w->nodes[0] = (struct wordNode){0, 0, -1, -1, -1, 0, 0, NULL};
+    w->n = 1;
+    w->free = -1;
+    w->nslot = 1024;
+    w->slot = calloc(w->nslot, sizeof(struct wordSlot));
+    w->built = 1;
+    for(int i = 0; i < E.numrows; i++) {
+        erow *row = &E.row[i];
+        unsigned char *hl = hlScratch(row->rsize);
+        hlExpand(row, hl);
+        wordsIndexRow(row, hl);
+    }
+}
+
+// writes the word ending at node n to buf, returns its length
+int wordsSpell(int n, char *buf) {
+    struct wordNode *node = &E.words.nodes[n];
+    memcpy(buf, node->word, node->len);
+    return node->len;
+}
+
+struct wordHeapItem {
+    int key;
+    int node;
+    int word;       // the word ending at node, rather than its subtree
+};
+
+static inline int wordHeapBefore(struct wordHeapItem *a, struct wordHeapItem *b) {
+    return a->key > b->key || (a->key == b->key && a->word > b->word);
+}
+
+void wordHeapPush(struct wordHeapItem **heap, int *n, int *cap, struct wordHeapItem item) {
+    if(*n == *cap) {
+        *cap *= 2;
+        *heap = realloc(*heap, sizeof(struct wordHeapItem) * *cap);
+    }
+    struct wordHeapItem *h = *heap;
+    int i = (*n)++;
+    while(i > 0 && wordHeapBefore(&item, &h[(i - 1) / 2])) {
+        h[i] = h[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h[i] = item;
+}
+
+struct wordHeapItem wordHeapPop(struct wordHeapItem *h, int *n) {
+    struct wordHeapItem top = h[0];
+    h[0] = h[--*n];
+    for(int i = 0; 2 * i + 1 < *n; ) {
+        int c = 2 * i + 1;
+        if(c + 1 < *n && wordHeapBefore(&h[c + 1], &h[c]))
+            c++;
+        if(!wordHeapBefore(&h[c], &h[i]))
+            break;
+        struct wordHeapItem t = h[i];
+        h[i] = h[c];
+        h[c] = t;
+        i = c;
+    }
+    return top;
+}
+
+// Fills out with up to max words longer than the prefix s that start with
+// it, most frequent first, and returns how many. Subtrees are opened in
+// order of their best count, so only the paths to the words returned and
+// their siblings are looked at.
+int wordsComplete(const char *s, int len, int *out, int max) {
+    struct wordNode *nodes = E.words.nodes;
+    int root = wordsNode(s, len, 0);
+    if(root == -1 || nodes[root].best == 0)
+        return 0;
+    int n = 0, nheap = 0, cap = 64;
+    struct wordHeapItem *heap = malloc(sizeof(struct wordHeapItem) * cap);
+    wordHeapPush(&heap, &nheap, &cap, (struct wordHeapItem){nodes[root].best, root, 0});
+    while(nheap > 0 && n < max) {
+        struct wordHeapItem top = wordHeapPop(heap, &nheap);
+        if(top.word) {
+            out[n++] = top.node;
+            continue;
+        }
+        if(top.node != root && nodes[top.node].count > 0)
+            wordHeapPush(&heap, &nheap, &cap, (struct wordHeapItem){nodes[top.node].count, top.node, 1});
+        for(int c = nodes[top.node].child; c != -1; c = nodes[c].next)
+            if(nodes[c].best > 0)
+                wordHeapPush(&heap, &nheap, &cap, (struct wordHeapItem){nodes[c].best, c, 0});
+    }
+    free(heap);
+    return n;
+}
+
+void editorComplete() {
+    // a completion in progress: the cursor is still right after it and
+    // nothing was edited since
+    static struct {
+        int row, at, len;
+        int cx, dirty;
+        // copied out: cycling edits the row, which may free their nodes
+        char cand[COMPLETE_MAX][WORD_MAX];
+        int candlen[COMPLETE_MAX];
+        int ncand;
+        int shown;          // candidate in the text, ncand for the bare prefix
+    } s = {.row = -1};
+
+    if(E.cy >= E.numrows)
+        return;
+    erow *row = &E.row[E.cy];
+    if(!(s.row == E.cy && s.cx == E.cx && s.dirty == E.dirty)) {
+        int at = E.cx;
+        while(at > 0 && isWordChar(row->chars[at - 1]))
+            at--;
+        if(at == E.cx || E.cx - at > WORD_MAX) {
+            editorSetStatusMessage("No word before the cursor to complete");
+            return;
+        }
+        if(!E.words.built)
+            wordsBuild();
+        s.row = E.cy;
+        s.at = at;
+        s.len = E.cx - at;
+        int nodes[COMPLETE_MAX];
+        s.ncand = wordsComplete(&row->chars[at], s.len, nodes, COMPLETE_MAX);
+        for(int i = 0; i < s.ncand; i++)
+            s.candlen[i] = wordsSpell(nodes[i], s.cand[i]);
+        s.shown = s.ncand;
+        if(s.ncand == 0) {
+            s.row = -1;
+            editorSetStatusMessage("No completions for %.*s", E.cx - at, &row->chars[at]);
+            return;
+        }
+    }
+
+    if(E.cx > s.at + s.len)
+        editorRowDelChar(row, s.at + s.len, E.cx - s.at - s.len);
+    s.shown = (s.shown + 1) % (s.ncand + 1);
+    if(s.shown < s.ncand) {
+        int len = s.candlen[s.shown];
+        editorRowInsertString(row, s.at + s.len, &s.cand[s.shown][s.len], len - s.len);
+        E.cx = s.at + len;
+        editorSetStatusMessage("Completion %d of %d", s.shown + 1, s.ncand);
+    } else {
+        E.cx = s.at + s.len;
+        editorSetStatusMessage("Back at the original word");
+    }
+    s.cx = E.cx;
+    s.dirty = E.dirty;
+}
+
+/*** selection ***/
+
+// Rows y0..y1 of the selection and, for block selections, the screen
+// columns [left, right) it covers.
+void editorSelectionBounds(int *y0, int *y1, int *left, int *right) {
+    *y0 = E.sel_cy < E.cy ? E.sel_cy : E.cy;
+    *y1 = E.sel_cy < E.cy ? E.cy : E.sel_cy;
+    if(*y1 >= E.numrows)
+        *y1 = E.numrows - 1;
+
+    int arx = E.sel_cy < E.numrows ? editorRowCxToRx(&E.row[E.sel_cy], E.sel_cx) : 0;
+    int crx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+    *left = arx < crx ? arx : crx;
+    *right = (arx < crx ? crx : arx) + 1;
+}
+
+// render range of row that is selected, if any
+int editorRowSelection(erow *row, int *r0, int *r1) {
+    if(E.sel_mode == SEL_NONE)
+        return 0;
+    int y0, y1, left, right;
+    editorSelectionBounds(&y0, &y1, &left, &right);
+    if(row->idx < y0 || row->idx > y1)
+        return 0;
+    if(E.sel_mode == SEL_LINES) {
+        *r0 = 0;
+        *r1 = row->rsize;
+    } else {
+        *r0 = editorRowColToR(row, left);
+        *r1 = editorRowColToR(row, right);
+    }
+    return 1;
+}
+
+void editorSelectStart(int mode) {
+    if(E.sel_mode == mode) {
+        E.sel_mode = SEL_NONE;
+        return;
+    }
+    E.sel_mode = mode;
+    E.sel_cx = E.cx;
+    E.sel_cy = E.cy;
+    editorSetStatusMessage(mode == SEL_LINES ? "Line selection: Ctrl-C copy, Ctrl-X cut"
+                                             : "Block selection: Ctrl-C copy, Ctrl-X cut");
+}
+
+void editorClipboardFree() {
+    for(int i = 0; i < E.clip.n; i++)
+        textRelease(E.clip.spans[i].base);
+    free(E.clip.spans);
+    E.clip.spans = NULL;
+    E.clip.n = 0;
+}
+
+// Yanks the selection. The clipboard only keeps references to the rows'
+// text blocks: nothing is copied.
+void editorCopy(int cut) {
+    if(E.sel_mode == SEL_NONE || E.numrows == 0) {
+        editorSetStatusMessage("Nothing selected (Ctrl-B lines, Ctrl-R block)");
+        return;
+    }
+    int y0, y1, left, right;
+    editorSelectionBounds(&y0, &y1, &left, &right);
+
+    editorClipboardFree();
+    E.clip.n = y1 - y0 + 1;
+    E.clip.spans = malloc(sizeof(struct textSpan) * E.clip.n);
+    E.clip.lines = (E.sel_mode == SEL_LINES);
+    for(int y = y0; y <= y1; y++) {
+        erow *row = &E.row[y];
+        struct textSpan *sp = &E.clip.spans[y - y0];
+        int cx0 = 0, cx1 = row->size;
+        if(!E.clip.lines) {
+            cx0 = editorRowRxToCx(row, left);
+            cx1 = editorRowRxToCx(row, right);
+            if(cx1 < cx0)
+                cx1 = cx0;
+        }
+        sp->base = textRetain(row->chars);
+        sp->s = row->chars + cx0;
+        sp->len = cx1 - cx0;
+    }
+
+    if(cut) {
+        if(E.clip.lines) {
+            editorDelRows(y0, y1 - y0 + 1);
+            E.cx = 0;
+        } else {
+            for(int y = y0; y <= y1; y++) {
+                struct textSpan *sp = &E.clip.spans[y - y0];
+                if(sp->len)
+                    editorRowDelChar(&E.row[y], sp->s - sp->base, sp->len);
+            }
+            E.cx = editorRowRxToCx(&E.row[y0], left);
+        }
+        E.cy = y0;
+    }
+    E.sel_mode = SEL_NONE;
+    editorSetStatusMessage("%d line%s %s", E.clip.n, E.clip.n == 1 ? "" : "s",
+                           cut ? "cut" : "copied");
+}
+
+// Line clipboards go in above the cursor row in one bulk insert; block
+// clipboards go in at the cursor column of successive rows.
+void editorPaste() {
+    if(E.clip.n == 0) {
+        editorSetStatusMessage("Clipboard is empty");
+        return;
+    }
+    if(E.clip.lines) {
+        editorInsertRows(E.cy, E.clip.spans, E.clip.n);
+        E.cx = 0;
+        return;
+    }
+
+    int rx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+    if(E.cy + E.clip.n > E.numrows) {
+        int extra = E.cy + E.clip.n - E.numrows;
+        struct textSpan *empty = calloc(extra, sizeof(struct textSpan));
+        for(int k = 0; k < extra; k++)
+            empty[k].s = "";
+        editorInsertRows(E.numrows, empty, extra);
+        free(empty);
+    }
+    for(int k = 0; k < E.clip.n; k++) {
+        erow *row = &E.row[E.cy + k];
+        int width = row->rcol ? row->rcol[row->rsize] : row->rsize;
+        struct textSpan *sp = &E.clip.spans[k];
+        if(width < rx) {
+            // a short row is padded out to the column and the text goes
+            // after the padding, in a single insert
+            int pad = rx - width;
+            char *buf = malloc(pad + sp->len);
+            memset(buf, ' ', pad);
+            memcpy(&buf[pad], sp->s, sp->len);
+            editorRowInsertString(row, row->size, buf, pad + sp->len);
+            free(buf);
+        } else {
+            editorRowInsertString(row, editorRowRxToCx(row, rx), sp->s, sp->len);
+        }
+    }
+    E.cx = editorRowRxToCx(&E.row[E.cy], rx);
+}
+
+/*** line commands ***/
+
+// Ctrl-E runs sort, uniq or grep over the selected lines, or the whole
+// buffer. The commands reorder or drop rows where they are: the text of a
+// row is never copied, and the result replaces the range as one change.
+
+int rowCompare(const void *a, const void *b) {
+    const erow *x = *(erow *const *)a, *y = *(erow *const *)b;
+    int n = x->size < y->size ? x->size : y->size;
+    int c = memcmp(x->chars, y->chars, n);
+    if(c)
+        return c;
+    return (x->size > y->size) - (x->size < y->size);
+}
+
+#define SORT_CHUNK_ROWS 16384   // fewest rows worth a thread of their own
+
+struct sortRun {
+    erow **src, **dst;
+    int lo, mid, hi;
+};
+
+void *sortRunWorker(void *arg) {
+    struct sortRun *r = arg;
+    qsort(r->src + r->lo, r->hi - r->lo, sizeof(erow *), rowCompare);
+    return NULL;
+}
+
+// merges src[lo, mid) and src[mid, hi) into dst[lo, hi)
+void *mergeRunWorker(void *arg) {
+    struct sortRun *r = arg;
+    int i = r->lo, j = r->mid, k = r->lo;
+    while(i < r->mid && j < r->hi)
+        r->dst[k++] = rowCompare(&r->src[j], &r->src[i]) < 0 ? r->src[j++] : r->src[i++];
+    while(i < r->mid)
+        r->dst[k++] = r->src[i++];
+    while(j < r->hi)
+        r->dst[k++] = r->src[j++];
+    return NULL;
+}
+
+// Sorts rows by their text: every core sorts a slice, then the slices are
+// merged pairwise, each round's merges running side by side.
+void editorSortRows(erow **rows, int n) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nruns = n / SORT_CHUNK_ROWS;
+    if(nruns > cpus)
+        nruns = cpus;
+    if(nruns < 2) {
+        qsort(rows, n, sizeof(erow *), rowCompare);
+        return;
+    }
+
+    int *bounds = malloc(sizeof(int) * (nruns + 1));
+    for(int i = 0; i <= nruns; i++)
+        bounds[i] = (long long)n * i / nruns;
+    struct sortRun *runs = malloc(sizeof(struct sortRun) * nruns);
+    struct worker *tids = malloc(sizeof(struct worker) * nruns);
+    for(int i = 0; i < nruns; i++) {
+        runs[i] = (struct sortRun){rows, NULL, bounds[i], 0, bounds[i + 1]};
+        workerStart(&tids[i], sortRunWorker, &runs[i]);
+    }
+    for(int i = 0; i < nruns; i++)
+        workerJoin(&tids[i]);
+
+    erow **src = rows, **dst = malloc(sizeof(erow *) * n);
+    while(nruns > 1) {
+        int merged = 0;
+        for(int i = 0; i + 1 < nruns; i += 2) {
+            runs[merged] = (struct sortRun){src, dst, bounds[i], bounds[i + 1], bounds[i + 2]};
+            workerStart(&tids[merged], mergeRunWorker, &runs[merged]);
+            merged++;
+        }
+        // an odd run out is carried over as it is
+        if(nruns % 2)
+            memcpy(&dst[bounds[nruns - 1]], &src[bounds[nruns - 1]],
+                   sizeof(erow *) * (n - bounds[nruns - 1]));
+        for(int i = 0; i < merged; i++)
+            workerJoin(&tids[i]);
+
+        int m = 0;
+        for(int i = 0; i < nruns; i += 2)
+            bounds[m++] = bounds[i];
+        bounds[m] = n;
+        nruns = m;
+        erow **t = src;
+        src = dst;
+        dst = t;
+    }
+    if(src != rows) {
+        memcpy(rows, src, sizeof(erow *) * n);
+        free(src);
+    } else {
+        free(dst);
+    }
+    free(tids);
+    free(runs);
+    free(bounds);
+}
+
+struct grepJob {
+    erow *rows;
+    int n;
+    const char *query;
+    int qlen;
+    char *match;
+};
+
+void *grepWorker(void *arg) {
+    struct grepJob *g = arg;
+    for(int i = 0; i < g->n; i++)
+        g->match[i] = editorRowFind(&g->rows[i], 0, g->query, g->qlen) != -1;
+    return NULL;
+}
+
+// match[i] is set if row at + i contains the query
+void editorGrepRows(int at, int n, const char *query, char *match) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = n / SORT_CHUNK_ROWS;
+    if(nthreads > cpus)
+        nthreads = cpus;
+    if(nthreads < 1)
+        nthreads = 1;
+    struct grepJob *jobs = malloc(sizeof(struct grepJob) * nthreads);
+    struct worker *tids = malloc(sizeof(struct worker) * nthreads);
+    for(int i = 0; i < nthreads; i++) {
+        int lo = (long long)n * i / nthreads, hi = (long long)n * (i + 1) / nthreads;
+        jobs[i] = (struct grepJob){&E.row[at + lo], hi - lo, query, strlen(query), &match[lo]};
+        if(i > 0)
+            workerStart(&tids[i], grepWorker, &jobs[i]);
+    }
+    grepWorker(&jobs[0]);
+    for(int i = 1; i < nthreads; i++)
+        workerJoin(&tids[i]);
+    free(tids);
+    free(jobs);
+}
+
+// Replaces rows at .. at + n - 1 with keep[0 .. m - 1], which are some of
+// those same rows in a new order. Rows left out are freed.
+void editorReplaceRows(int at, int n, erow **keep, int m) {
+    struct textSpan *spans = malloc(sizeof(struct textSpan) * (m > 0 ? m : 1));
+    for(int i = 0; i < m; i++)
+        spans[i] = (struct textSpan){NULL, keep[i]->chars, keep[i]->size};
+    journalDelRows(at, n);
+    journalRows(at, spans, m);
+    free(spans);
+
+    // a row's highlighting only depends on the open comment state it was
+    // entered in, so moved rows keep theirs unless that state differs at
+    // their new place
+    char *entered = malloc(m > 0 ? m : 1);
+    int follows = E.row[at + n - 1].hl_open_comment != 0;
+    char *kept = calloc(n, 1);
+    erow *tmp = malloc(sizeof(erow) * (m > 0 ? m : 1));
+    for(int i = 0; i < m; i++) {
+        kept[keep[i] - &E.row[at]] = 1;
+        tmp[i] = *keep[i];
+        entered[i] = keep[i]->idx > 0 && E.row[keep[i]->idx - 1].hl_open_comment;
+    }
+    for(int i = 0; i < n; i++)
+        if(!kept[i])
+            editorFreeRow(&E.row[at + i]);
+    memcpy(&E.row[at], tmp, sizeof(erow) * m);
+    memmove(&E.row[at + m], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+    E.numrows += m - n;
+    editorDiffEdit(at, n, m - n);
+    for(int j = at; j < E.numrows; j++)
+        E.row[j].idx = j;
+    free(tmp);
+    free(kept);
+
+    E.lineidx.stale = 1;
+    E.wrapidx.stale = 1;
+    PROBE_BEGIN(PERF_SYNTAX);
+    for(int i = 0; i < m; i++) {
+        erow *row = &E.row[at + i];
+        if((row->idx > 0 && E.row[row->idx - 1].hl_open_comment) != entered[i])
+            editorHighlightFrom(row, hlScratch(row->rsize), 0, row->rsize + 1);
+    }
+    PROBE_END(PERF_SYNTAX);
+    free(entered);
+    if(at + m < E.numrows && (at + m > 0 && E.row[at + m - 1].hl_open_comment) != follows)
+        editorUpdateSyntax(&E.row[at + m]);
+    E.dirty++;
+}
+
+void editorLineCommand() {
+    char *cmd = editorPrompt("Lines: %s (sort, sort -r, uniq, grep TEXT, grep -v TEXT)", NULL);
+    if(cmd == NULL)
+        return;
+
+    int at = 0, n = E.numrows;
+    if(E.sel_mode == SEL_LINES) {
+        int y0, y1, left, right;
+        editorSelectionBounds(&y0, &y1, &left, &right);
+        at = y0;
+        n = y1 - y0 + 1;
+    }
+    if(n <= 0) {
+        free(cmd);
+        return;
+    }
+
+    erow **rows = malloc(sizeof(erow *) * n);
+    int m = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if(!strcmp(cmd, "sort") || !strcmp(cmd, "sort -r")) {
+        for(int i = 0; i < n; i++)
+            rows[i] = &E.row[at + i];
+        editorSortRows(rows, n);
+        if(cmd[4]) {
+            for(int i = 0; i < n / 2; i++) {
+                erow *t = rows[i];
+                rows[i] = rows[n - 1 - i];
+                rows[n - 1 - i] = t;
+            }
+        }
+        m = n;
+    } else if(!strcmp(cmd, "uniq")) {
+        // drops lines equal to the line before them
+        for(int i = 0; i < n; i++) {
+            erow *row = &E.row[at + i];
+            if(m == 0 || rowCompare(&rows[m - 1], &row) != 0)
+                rows[m++] = row;
+        }
+    } else if(!strncmp(cmd, "grep", 4) && (cmd[4] == ' ' || cmd[4] == '\0')) {
+        // grep [-v] TEXT: the flag is a word of its own, the rest is TEXT
+        char *query = cmd + 4;
+        while(*query == ' ')
+            query++;
+        int invert = !strncmp(query, "-v", 2) && (query[2] == ' ' || query[2] == '\0');
+        if(invert)
+            query += 2;
+        while(*query == ' ')
+            query++;
+        if(*query == '\0') {
+            editorSetStatusMessage("Usage: grep [-v] TEXT");
+            free(rows);
+            free(cmd);
+            return;
+        }
+        char *match = malloc(n);
+        editorGrepRows(at, n, query, match);
+        for(int i = 0; i < n; i++)
+            if(match[i] != invert)
+                rows[m++] = &E.row[at + i];
+        free(match);
+    } else {
+        editorSetStatusMessage("Unknown command: %s", cmd);
+        free(rows);
+        free(cmd);
+        return;
+    }
+
+    int changed = (m != n);
+    for(int i = 0; i < m && !changed; i++)
+        changed = (rows[i] != &E.row[at + i]);
+    if(changed)
+        editorReplaceRows(at, n, rows, m);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    editorSetStatusMessage("%s: %d lines -> %d (%.0f ms)", cmd, n, m, ms);
+
+    E.sel_mode = SEL_NONE;
+    E.cy = at;
+    E.cx = 0;
+    free(rows);
+    free(cmd);
+}
+
+/*** journal ***/
+
+// Unsaved edits are appended as compact records to a swap file next to the
+// file being edited (.name.swp). The editing path only appends to a memory
+// buffer; a background thread writes and fsyncs it every
+// JOURNAL_INTERVAL_MS. If tedit dies, the next start on the same file offers
+// to replay the swap file on top of it. Saving empties the swap file again.
+
+#define JOURNAL_MAGIC "TEDITSW1"
+#define JOURNAL_INTERVAL_MS 1000
+
+enum journalOp {
+    JOURNAL_INSERT = 'i',       // row, at, len, bytes
+    JOURNAL_DELETE = 'd',       // row, at, len
+    JOURNAL_ROWS = 'R',         // at, n, then n times: len, bytes
+    JOURNAL_DELROWS = 'X'       // at, n
+};
+
+struct journal {
+    int fd;                 // -1 while there is no swap file
+    char *path;
+    char *buf;              // records not written yet
+    size_t len, cap;
+    int replaying;
+    int disabled;           // batch mode
+    int stop;
+    int started;
+    pthread_t writer;
+    pthread_mutex_t lock;   // guards buf; never held across I/O
+    pthread_mutex_t io;     // held by whoever writes to fd
+    pthread_cond_t wake;
+};
+
+struct journal J = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .io = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER
+};
+
+char *journalPath(const char *filename) {
+    const char *base = strrchr(filename, '/');
+    int dirlen = base ? base - filename + 1 : 0;
+    base = base ? base + 1 : filename;
+    char *path = malloc(strlen(filename) + 6);
+    sprintf(path, "%.*s.%s.swp", dirlen, filename, base);
+    return path;
+}
+
+void journalPut(const void *p, size_t n) {
+    if(J.len + n > J.cap) {
+        J.cap = J.cap * 2 > J.len + n ? J.cap * 2 : J.len + n + 4096;
+        J.buf = realloc(J.buf, J.cap);
+    }
+    memcpy(J.buf + J.len, p, n);
+    J.len += n;
+}
+
+// LEB128, so small numbers take a single byte
+void journalPutNum(unsigned long long v) {
+    unsigned char b[10];
+    int n = 0;
+    do {
+        b[n] = v & 0x7f;
+        v >>= 7;
+        if(v)
+            b[n] |= 0x80;
+        n++;
+    } while(v);
+    journalPut(b, n);
+}
+
+int journalActive() {
+    return J.fd != -1 && !J.replaying;
+}
+
+void journalInsert(int row, int at, const char *s, int len) {
+    if(!journalActive())
+        return;
+    pthread_mutex_lock(&J.lock);
+    journalPut("i", 1);
+    journalPutNum(row);
+    journalPutNum(at);
+    journalPutNum(len);
+    journalPut(s, len);
+    pthread_mutex_unlock(&J.lock);
+}
+
+void journalDelete(int row, int at, int len) {
+    if(!journalActive())
+        return;
+    pthread_mutex_lock(&J.lock);
+    journalPut("d", 1);
+    journalPutNum(row);
+    journalPutNum(at);
+    journalPutNum(len);
+    pthread_mutex_unlock(&J.lock);
+}
+
+void journalRows(int at, struct textSpan *spans, int n) {
+    if(!journalActive())
+        return;
+    pthread_mutex_lock(&J.lock);
+    journalPut("R", 1);
+    journalPutNum(at);
+    journalPutNum(n);
+    for(int k = 0; k < n; k++) {
+        journalPutNum(spans[k].len);
+        journalPut(spans[k].s, spans[k].len);
+    }
+    pthread_mutex_unlock(&J.lock);
+}
+
+void journalDelRows(int at, int n) {
+    if(!journalActive())
+        return;
+    pthread_mutex_lock(&J.lock);
+    journalPut("X", 1);
+    journalPutNum(at);
+    journalPutNum(n);
+    pthread_mutex_unlock(&J.lock);
+}
+
+int writeAll(int fd, const char *p, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Moves buffered records to disk. Called with J.io held.
+void journalFlush() {
+    pthread_mutex_lock(&J.lock);
+    char *out = J.buf;
+    size_t len = J.len;
+    J.buf = NULL;
+    J.len = J.cap = 0;
+    pthread_mutex_unlock(&J.lock);
+
+    if(len && J.fd != -1 && writeAll(J.fd, out, len) == 0)
+        fdatasync(J.fd);
+    free(out);
+}
+
+void *journalWriter(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&J.io);
+    while(!J.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += JOURNAL_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (JOURNAL_INTERVAL_MS % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&J.wake, &J.io, &deadline);
+        journalFlush();
+    }
+    pthread_mutex_unlock(&J.io);
+    return NULL;
+}
+
+// The header ties the journal to the file as it is on disk, so it is never
+// replayed on top of a different version.
+void journalHeader(char *hdr) {
+    struct stat st;
+    long long size = 0, mtime = 0;
+    if(stat(E.filename, &st) == 0) {
+        size = st.st_size;
+        mtime = st.st_mtime;
+    }
+    memcpy(hdr, JOURNAL_MAGIC, 8);
+    memcpy(hdr + 8, &size, 8);
+    memcpy(hdr + 16, &mtime, 8);
+}
+
+// Empties the swap file, dropping records that are now saved. Called with
+// J.io held.
+void journalTruncate() {
+    pthread_mutex_lock(&J.lock);
+    J.len = 0;
+    pthread_mutex_unlock(&J.lock);
+
+    char hdr[24];
+    journalHeader(hdr);
+    if(ftruncate(J.fd, 0) == -1 || writeAll(J.fd, hdr, sizeof(hdr)) == -1)
+        editorSetStatusMessage("Swap file error: %s", strerror(errno));
+}
+
+// Starts journaling edits to E.filename's swap file. With keep set, the
+// existing records (just replayed) are kept and appended to.
+void journalStart(int keep) {
+    if(E.filename == NULL || J.fd != -1)
+        return;
+    J.path = journalPath(E.filename);
+    J.fd = open(J.path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if(J.fd == -1) {
+        free(J.path);
+        J.path = NULL;
+        return;
+    }
+    if(!keep)
+        journalTruncate();
+
+    J.stop = 0;
+    if(pthread_create(&J.writer, NULL, journalWriter, NULL) == 0)
+        J.started = 1;
+}
+
+// called after a successful save
+void journalSaved() {
+    if(J.disabled)
+        return;
+    if(J.fd == -1) {
+        journalStart(0);
+        return;
+    }
+    pthread_mutex_lock(&J.io);
+    journalTruncate();
+    pthread_mutex_unlock(&J.io);
+}
+
+// Stops the writer; a clean exit also removes the swap file.
+void journalClose(int remove) {
+    if(J.fd == -1)
+        return;
+    if(J.started) {
+        pthread_mutex_lock(&J.io);
+        J.stop = 1;
+        pthread_cond_signal(&J.wake);
+        pthread_mutex_unlock(&J.io);
+        pthread_join(J.writer, NULL);
+        J.started = 0;
+    }
+    if(!remove)
+        journalFlush();
+    close(J.fd);
+    J.fd = -1;
+    if(remove)
+        unlink(J.path);
+    free(J.path);
+    J.path = NULL;
+}
+
+int journalGetNum(const unsigned char **p, const unsigned char *end, long long *v) {
+    unsigned long long x = 0;
+    int shift = 0;
+    while(*p < end && shift < 64) {
+        unsigned char b = *(*p)++;
+        x |= (unsigned long long)(b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            *v = x;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+// Applies the records in data to the buffer. Stops at the first record
+// that is truncated, since the crash may have cut the last one. Returns
+// the number of records applied, or -1 if a record doesn't fit the
+// buffer or the data is garbage; the buffer is then left half replayed
+// and the caller has to reload it.
+int journalReplay(const unsigned char *p, const unsigned char *end) {
+    int applied = 0;
+    J.replaying = 1;
+    while(p < end) {
+        int op = *p++;
+        long long a, b, c;
+        if(op == JOURNAL_INSERT || op == JOURNAL_DELETE) {
+            if(journalGetNum(&p, end, &a) || journalGetNum(&p, end, &b) ||
+               journalGetNum(&p, end, &c))
+                break;
+            if(a < 0 || a >= E.numrows || b < 0 || b > E.row[a].size || c < 0)
+                goto corrupt;
+            if(op == JOURNAL_INSERT) {
+                if(c > end - p)
+                    break;
+                editorRowInsertString(&E.row[a], b, (char *)p, c);
+                p += c;
+            } else {
+                editorRowDelChar(&E.row[a], b, c);
+            }
+        } else if(op == JOURNAL_ROWS) {
+            if(journalGetNum(&p, end, &a) || journalGetNum(&p, end, &b))
+                break;
+            // every row takes at least its length byte
+            if(a < 0 || a > E.numrows || b < 0)
+                goto corrupt;
+            if(b > end - p)
+                break;
+            struct textSpan *spans = malloc(sizeof(struct textSpan) * (b ? b : 1));
+            long long k;
+            for(k = 0; k < b; k++) {
+                if(journalGetNum(&p, end, &c) || c < 0 || c > end - p)
+                    break;
+                spans[k] = (struct textSpan){NULL, (char *)p, c};
+                p += c;
+            }
+            if(k == b)
+                editorInsertRows(a, spans, b);
+            free(spans);
+            if(k != b)
+                break;
+        } else if(op == JOURNAL_DELROWS) {
+            if(journalGetNum(&p, end, &a) || journalGetNum(&p, end, &b))
+                break;
+            if(a < 0 || a >= E.numrows || b < 0)
+                goto corrupt;
+            editorDelRows(a, b);
+        } else {
+            break;
+        }
+        applied++;
+    }
+    J.replaying = 0;
+    return applied;
+
+corrupt:
+    J.replaying = 0;
+    return -1;
+}
+
+// Offers to replay a swap file left behind for E.filename, then starts
+// journaling.
+void editorRecover() {
+    char *path = journalPath(E.filename);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1 || st.st_size <= 24) {
+        if(fd != -1)
+            close(fd);
+        free(path);
+        journalStart(0);
+        return;
+    }
+
+    unsigned char *data = malloc(st.st_size);
+    ssize_t len = read(fd, data, st.st_size);
+    close(fd);
+
+    char hdr[24];
+    journalHeader(hdr);
+    if(len != st.st_size || memcmp(data, hdr, sizeof(hdr))) {
+        // written against another version of the file: keep it aside
+        char *old = malloc(strlen(path) + 2);
+        sprintf(old, "%s~", path);
+        rename(path, old);
+        editorSetStatusMessage("Swap file doesn't match %s, moved to %s", E.filename, old);
+        free(old);
+        free(data);
+        free(path);
+        journalStart(0);
+        return;
+    }
+
+    editorSetStatusMessage("Found unsaved changes in %s. Recover them? (y/n)", path);
+    editorRefreshScreen();
+    int c;
+    while((c = editorReadKey()) != 'y' && c != 'n' && c != '\x1b')
+        ;
+    int n = c == 'y' ? journalReplay(data + 24, data + len) : 0;
+    if(n == -1) {
+        // back to the file as it is on disk, and the swap file kept aside
+        char *name = strdup(E.filename);
+        editorDelRows(0, E.numrows);
+        editorOpen(name);
+        free(name);
+        char *old = malloc(strlen(path) + 2);
+        sprintf(old, "%s~", path);
+        rename(path, old);
+        editorSetStatusMessage("Swap file is corrupt, nothing recovered; moved to %s", old);
+        free(old);
+    } else if(c == 'y') {
+        E.dirty = n;
+        editorSetStatusMessage("Recovered %d edits", n);
+    }
+    free(data);
+    free(path);
+    journalStart(c == 'y' && n != -1);
+}
+
+/*** diff ***/
+
+// Ctrl-D compares the buffer with the file on disk. Lines common to both
+// ends are trimmed first. The rest are numbered by content, and the lines
+// found exactly once in the file and once in the buffer, in the same
+// order, become anchors (as in patience diff) that split the middle into
+// independent segments. Rows between segments match lines of the file one
+// to one. A segment is run through Myers' algorithm only when one of its
+// rows is drawn, and an edit merges the segments it touches into one to
+// be diffed again, so neither the first screen nor a keystroke has to
+// diff the whole file.
+
+#define DIFF_GUTTER 2
+#define DIFF_MAX_COST 1024      // edits before a segment is marked changed whole
+#define DIFF_ANCHOR_MIN 1024    // middles with fewer lines are one segment
+#define DIFF_BATCH 16           // lines hashed ahead of their table lookups
+
+enum diffMark {
+    DIFF_SAME = 0,
+    DIFF_ADDED,         // row not in the file
+    DIFF_CHANGED,       // row replacing lines of the file
+    DIFF_REMOVED,       // lines of the file were removed before this row
+    DIFF_PENDING        // segment not diffed yet
+};
+
+struct diffLine {
+    const char *s;
+    int len;
+};
+
+// file lines a0 .. a1 - 1 against buffer rows b0 .. b1 - 1
+struct diffSegment {
+    int a0, a1;
+    int b0, b1;
+    int done;
+};
+
+// one distinct line of the file
+struct diffClass {
+    const char *s;
+    int len;
+    int count;
+};
+
+// the hash is kept with the class so that probing stays in the table
+struct diffSlot {
+    unsigned long long hash;
+    int cls;            // class + 1, 0 if free
+};
+
+struct diffState {
+    int on;
+    char *text;         // the file as it was read; old lines point into it
+    size_t textlen;
+    struct diffLine *old;
+    int nold;
+    int *aid;           // class of each line, once classified
+    struct diffClass *cls;
+    int ncls;
+    struct diffSlot *slot;
+    int nslot;
+    unsigned char *mark;    // enum diffMark of each row, and one past the end
+    struct diffSegment *seg;
+    int nseg, segcap;
+    int numrows;
+};
+
+struct diffState D = {0};
+
+unsigned long long diffHash(const char *s, int len) {
+    unsigned long long h = 14695981039346656037ull;
+    for(int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+int diffEqual(int a, int b) {
+    erow *row = &E.row[b];
+    return D.old[a].len == row->size && !memcmp(D.old[a].s, row->chars, row->size);
+}
+
+void diffCompute();
+
+// Reads the file, splits it into lines the way editorOpen does and diffs
+// the buffer against it. A missing file has no lines. The file is read
+// rather than mapped: the gutter stays on for long, and a mapping would
+// fault if another program truncated the file meanwhile.
+void diffLoad() {
+    D.text = NULL;
+    D.textlen = 0;
+    D.nold = 0;
+    int fd = open(E.filename, O_RDONLY);
+    struct stat st;
+    if(fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        D.text = malloc(st.st_size);
+        ssize_t n;
+        while(D.textlen < (size_t)st.st_size &&
+              (n = read(fd, D.text + D.textlen, st.st_size - D.textlen)) > 0)
+            D.textlen += n;
+    }
+    if(fd != -1)
+        close(fd);
+
+    int cap = 0;
+    char *p = D.text, *end = D.text + D.textlen;
+    while(p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        int linelen = (nl ? nl : end) - p;
+        while(linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+        if(D.nold == cap) {
+            cap = cap ? cap * 2 : 1024;
+            D.old = realloc(D.old, sizeof(struct diffLine) * cap);
+        }
+        D.old[D.nold++] = (struct diffLine){p, linelen};
+        p = nl ? nl + 1 : end;
+    }
+    diffCompute();
+}
+
+void diffUnload() {
+    free(D.text);
+    D.text = NULL;
+    D.textlen = 0;
+    D.nold = 0;
+    free(D.aid);
+    free(D.cls);
+    free(D.slot);
+    D.aid = NULL;
+    D.cls = NULL;
+    D.slot = NULL;
+    D.ncls = 0;
+}
+
+// class of a line with this text, -1 if the file has none
+int diffLookup(const char *s, int len, unsigned long long h) {
+    int k = h & (D.nslot - 1);
+    while(D.slot[k].cls) {
+        if(D.slot[k].hash == h) {
+            struct diffClass *c = &D.cls[D.slot[k].cls - 1];
+            if(c->len == len && !memcmp(c->s, s, len))
+                return D.slot[k].cls - 1;
+        }
+        k = (k + 1) & (D.nslot - 1);
+    }
+    return -k - 1;
+}
+
+// Numbers the lines of the file by content, the first time it is needed.
+void diffClassify() {
+    if(D.slot)
+        return;
+    D.nslot = 16;
+    while(D.nslot < 2 * D.nold)
+        D.nslot *= 2;
+    D.slot = calloc(D.nslot, sizeof(struct diffSlot));
+    D.cls = malloc(sizeof(struct diffClass) * (D.nold ? D.nold : 1));
+    D.aid = malloc(sizeof(int) * (D.nold ? D.nold : 1));
+    unsigned long long hash[DIFF_BATCH];
+    for(int i = 0; i < D.nold; i++) {
+        // the table is far bigger than the cache, so a batch of slots is
+        // fetched before the first of them is probed
+        if(i % DIFF_BATCH == 0) {
+            for(int j = 0; j < DIFF_BATCH && i + j < D.nold; j++) {
+                hash[j] = diffHash(D.old[i + j].s, D.old[i + j].len);
+                __builtin_prefetch(&D.slot[hash[j] & (D.nslot - 1)]);
+            }
+        }
+        unsigned long long h = hash[i % DIFF_BATCH];
+        int c = diffLookup(D.old[i].s, D.old[i].len, h);
+        if(c < 0) {
+            D.slot[-c - 1] = (struct diffSlot){h, D.ncls + 1};
+            c = D.ncls++;
+            D.cls[c] = (struct diffClass){D.old[i].s, D.old[i].len, 0};
+        }
+        D.cls[c].count++;
+        D.aid[i] = c;
+    }
+}
+
+// class of rows from .. to - 1, -1 for lines the file doesn't have
+void diffRowClasses(int from, int to, int *out) {
+    unsigned long long hash[DIFF_BATCH];
+    for(int i = from; i < to; i += DIFF_BATCH) {
+        int n = to - i < DIFF_BATCH ? to - i : DIFF_BATCH;
+        for(int j = 0; j < n; j++) {
+            hash[j] = diffHash(E.row[i + j].chars, E.row[i + j].size);
+            __builtin_prefetch(&D.slot[hash[j] & (D.nslot - 1)]);
+        }
+        for(int j = 0; j < n; j++) {
+            int c = diffLookup(E.row[i + j].chars, E.row[i + j].size, hash[j]);
+            out[i - from + j] = c < 0 ? -1 : c;
+        }
+    }
+}
+
+void diffAddSegment(int a0, int a1, int b0, int b1) {
+    if(a0 == a1 && b0 == b1)
+        return;
+    if(D.nseg == D.segcap) {
+        D.segcap = D.segcap ? D.segcap * 2 : 64;
+        D.seg = realloc(D.seg, sizeof(struct diffSegment) * D.segcap);
+    }
+    D.seg[D.nseg++] = (struct diffSegment){a0, a1, b0, b1, 0};
+}
+
+// Marks rows b0 .. b1 - 1 as one change that also removed lines of the
+// file if del is set. Lines removed with no row in their place are shown
+// on the row after them.
+void diffMarkHunk(int b0, int b1, int del) {
+    if(b0 == b1) {
+        if(del)
+            D.mark[b0] = DIFF_REMOVED;
+        return;
+    }
+    memset(&D.mark[b0], del ? DIFF_CHANGED : DIFF_ADDED, b1 - b0);
+}
+
+// Shortest edit script from ids a[0 .. n) to b[0 .. m) by Myers' greedy
+// algorithm. Sets ins[j] for each inserted row j, and del[j] to the lines
+// removed right before row j (j == m being the end). Returns -1 if that
+// takes more than DIFF_MAX_COST edits.
+int diffMyers(const int *a, int n, const int *b, int m, unsigned char *ins, int *del) {
+    int limit = n + m < DIFF_MAX_COST ? n + m : DIFF_MAX_COST;
+    int off = limit + 1;
+    int *v = malloc(sizeof(int) * (2 * limit + 3));
+    // v after cost d is kept at trace[d * d], for k = -d .. d
+    int *trace = NULL, tracecap = 0;
+    int cost = -1;
+    v[off + 1] = 0;
+    for(int d = 0; d <= limit && cost < 0; d++) {
+        for(int k = -d; k <= d; k += 2) {
+            int x;
+            if(k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+                x = v[off + k + 1];
+            else
+                x = v[off + k - 1] + 1;
+            int y = x - k;
+            while(x < n && y < m && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            v[off + k] = x;
+            if(x >= n && y >= m)
+                cost = d;
+        }
+        if((d + 1) * (d + 1) > tracecap) {
+            tracecap = tracecap ? tracecap * 4 : 64;
+            trace = realloc(trace, sizeof(int) * tracecap);
+        }
+        memcpy(&trace[d * d], &v[off - d], sizeof(int) * (2 * d + 1));
+    }
+    free(v);
+    if(cost < 0) {
+        free(trace);
+        return -1;
+    }
+
+    memset(ins, 0, m);
+    memset(del, 0, sizeof(int) * (m + 1));
+    int x = n, y = m;
+    for(int d = cost; d > 0; d--) {
+        int *prev = &trace[(d - 1) * (d - 1) + (d - 1)];    // prev[k], k = -(d-1) .. d-1
+        int k = x - y;
+        int pk = (k == -d || (k != d && prev[k - 1] < prev[k + 1])) ? k + 1 : k - 1;
+        int px = prev[pk], py = px - pk;
+        if(pk == k + 1)
+            ins[py] = 1;
+        else
+            del[py]++;
+        x = px;
+        y = py;
+    }
+    free(trace);
+    return cost;
+}
+
+void diffSegmentRun(struct diffSegment *s) {
+    int n = s->a1 - s->a0, m = s->b1 - s->b0;
+    s->done = 1;
+    memset(&D.mark[s->b0], DIFF_SAME, m + 1);
+    if(n == 0 || m == 0) {
+        diffMarkHunk(s->b0, s->b1, n);
+        return;
+    }
+    diffClassify();
+    int *bid = malloc(sizeof(int) * m);
+    diffRowClasses(s->b0, s->b1, bid);
+    unsigned char *ins = malloc(m);
+    int *del = malloc(sizeof(int) * (m + 1));
+    if(diffMyers(&D.aid[s->a0], n, bid, m, ins, del) < 0) {
+        diffMarkHunk(s->b0, s->b1, 1);
+    } else {
+        for(int j = 0; j <= m; j++) {
+            int j0 = j, dels = del[j];
+            while(j < m && ins[j])
+                dels += del[++j];
+            diffMarkHunk(s->b0 + j0, s->b0 + j, dels);
+        }
+    }
+    free(bid);
+    free(ins);
+    free(del);
+}
+
+// Splits file lines pre .. a1 - 1 and rows pre .. b1 - 1 into segments
+// at the anchors.
+void diffAnchor(int pre, int a1, int b1) {
+    diffClassify();
+    int *seen = calloc(D.ncls ? D.ncls : 1, sizeof(int));   // occurrences in the rows
+    int *where = malloc(sizeof(int) * (D.ncls ? D.ncls : 1));
+    int *bid = malloc(sizeof(int) * (b1 - pre));
+    diffRowClasses(pre, b1, bid);
+    for(int j = pre; j < b1; j++) {
+        int c = bid[j - pre];
+        if(c >= 0) {
+            seen[c]++;
+            where[c] = j;
+        }
+    }
+
+    // candidates in file order, then the longest run of them that is also
+    // in buffer order
+    int *anc = malloc(sizeof(int) * (a1 - pre + 1));
+    int nanc = 0;
+    for(int i = pre; i < a1; i++) {
+        int c = D.aid[i];
+        if(D.cls[c].count == 1 && seen[c] == 1)
+            anc[nanc++] = i;
+    }
+    int *tail = malloc(sizeof(int) * (nanc + 1));   // candidate ending a run of each length
+    int *link = malloc(sizeof(int) * (nanc + 1));   // candidate before it in its run
+    int len = 0;
+    for(int i = 0; i < nanc; i++) {
+        int b = where[D.aid[anc[i]]];
+        int lo = 0, hi = len;
+        while(lo < hi) {
+            int mid = (lo + hi) / 2;
+            if(where[D.aid[anc[tail[mid]]]] < b)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        link[i] = lo ? tail[lo - 1] : -1;
+        tail[lo] = i;
+        if(lo == len)
+            len++;
+    }
+    int *chain = malloc(sizeof(int) * (len + 1));
+    for(int i = len ? tail[len - 1] : -1, k = len; i >= 0; i = link[i])
+        chain[--k] = anc[i];
+
+    int a = pre, b = pre;
+    for(int k = 0; k < len; k++) {
+        int ai = chain[k], bi = where[D.aid[ai]];
+        diffAddSegment(a, ai, b, bi);
+        a = ai + 1;
+        b = bi + 1;
+    }
+    diffAddSegment(a, a1, b, b1);
+    free(chain);
+    free(tail);
+    free(link);
+    free(anc);
+    free(where);
+    free(seen);
+    free(bid);
+}
+
+// Diffs the buffer against the loaded file, leaving the segments with
+// lines on both sides for editorDiffMark.
+void diffCompute() {
+    int n = D.nold, m = E.numrows;
+    D.mark = realloc(D.mark, m + 1);
+    memset(D.mark, DIFF_SAME, m + 1);
+    D.nseg = 0;
+    D.numrows = m;
+
+    int pre = 0, suf = 0;
+    while(pre < n && pre < m && diffEqual(pre, pre))
+        pre++;
+    while(suf < n - pre && suf < m - pre && diffEqual(n - 1 - suf, m - 1 - suf))
+        suf++;
+    int a1 = n - suf, b1 = m - suf;
+    if(pre == a1 || pre == b1 || (a1 - pre) + (b1 - pre) < DIFF_ANCHOR_MIN)
+        diffAddSegment(pre, a1, pre, b1);
+    else
+        diffAnchor(pre, a1, b1);
+
+    for(int k = 0; k < D.nseg; k++) {
+        struct diffSegment *s = &D.seg[k];
+        if(s->a0 == s->a1 || s->b0 == s->b1)
+            diffSegmentRun(s);
+        else
+            memset(&D.mark[s->b0], DIFF_PENDING, s->b1 - s->b0);
+    }
+}
+
+// Rows at .. at + n - 1 were replaced by n + delta rows. They, and the
+// segments they touch, become one segment to be diffed again.
+void editorDiffEdit(int at, int n, int delta) {
+    if(!D.on || at + n > D.numrows)
+        return;
+    int end = at + n;
+    // first segment ending at or after the rows, and past the last one
+    // starting at or before their end
+    int lo = 0, hi = D.nseg;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(D.seg[mid].b1 < at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int k0 = lo, k1 = lo;
+    while(k1 < D.nseg && D.seg[k1].b0 <= end)
+        k1++;
+    // rows outside the segments are file lines shifted by the same amount
+    // as the end of the segment before them
+    int skew = k0 > 0 ? D.seg[k0 - 1].a1 - D.seg[k0 - 1].b1 : 0;
+    struct diffSegment s = {at + skew, end + skew, at, end, 0};
+    if(k1 > k0) {
+        struct diffSegment *first = &D.seg[k0], *last = &D.seg[k1 - 1];
+        if(first->b0 < s.b0) {
+            s.b0 = first->b0;
+            s.a0 = first->a0;
+        }
+        if(last->b1 >= s.b1) {
+            s.b1 = last->b1;
+            s.a1 = last->a1;
+        } else {
+            s.a1 = end + last->a1 - last->b1;
+        }
+    }
+
+    // the marks after the rows move with them
+    int tail = D.numrows + 1 - s.b1;
+    if(delta > 0)
+        D.mark = realloc(D.mark, D.numrows + delta + 1);
+    memmove(&D.mark[s.b1 + delta], &D.mark[s.b1], tail);
+    if(delta < 0)
+        D.mark = realloc(D.mark, D.numrows + delta + 1);
+    D.numrows += delta;
+    s.b1 += delta;
+    memset(&D.mark[s.b0], DIFF_PENDING, s.b1 - s.b0);
+    D.mark[s.b1] = DIFF_SAME;
+
+    // s takes the place of segments k0 .. k1 - 1
+    if(k1 == k0 && D.nseg == D.segcap) {
+        D.segcap = D.segcap ? D.segcap * 2 : 64;
+        D.seg = realloc(D.seg, sizeof(struct diffSegment) * D.segcap);
+    }
+    memmove(&D.seg[k0 + 1], &D.seg[k1], sizeof(struct diffSegment) * (D.nseg - k1));
+    D.nseg += 1 - (k1 - k0);
+    D.seg[k0] = s;
+    for(int k = k0 + 1; k < D.nseg; k++) {
+        D.seg[k].b0 += delta;
+        D.seg[k].b1 += delta;
     }
-    E.cy++;
-    E.cx = 0;
 }
 
-void editorDelChar() {
-  if (E.cy == E.numrows) 
-    return;
-  if (E.cx == 0 && E.cy == 0)
-    return;
+// The mark of a row, or of the line past the end, diffing its segment
+// first if needed.
+int editorDiffMark(int at) {
+    if(D.numrows != E.numrows)
+        diffCompute();
+    // the last segment starting at or before the row; lines removed at
+    // its end are marked on the row after it
+    int lo = 0, hi = D.nseg - 1;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(D.seg[mid].b0 <= at)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    if(D.nseg && !D.seg[lo].done && D.seg[lo].b0 <= at && at <= D.seg[lo].b1)
+        diffSegmentRun(&D.seg[lo]);
+    return D.mark[at];
+}
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
-  }
+void editorToggleDiff() {
+    if(D.on) {
+        D.on = 0;
+        E.gutter = 0;
+        diffUnload();
+        return;
+    }
+    if(E.filename == NULL) {
+        editorSetStatusMessage("No file on disk to compare with");
+        return;
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    diffLoad();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    D.on = 1;
+    E.gutter = DIFF_GUTTER;
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    editorSetStatusMessage("Diff against disk (%.0f ms), Ctrl-D to close", ms);
 }
 
 /*** file i/o ***/
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
+char *editorRowsToString(size_t *buflen) {
+    size_t totlen = editorRowOffset(E.numrows);
     int i;
-    for( i = 0 ; i < E.numrows ; i++) {
-        totlen += E.row[i].size + 1;
-    }
 
     *buflen = totlen;
 
@@ -646,23 +4167,36 @@ void editorSave() {
 		editorSelectSyntaxHighlight();
     }
 
-    int len;
+    size_t len;
     char *buf = editorRowsToString(&len);
 
+    // the file is rewritten in place, so the diff view lets go of it
+    if(D.on)
+        diffUnload();
     int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
     if(fd != -1) {
         if(ftruncate(fd, len) != -1) {
-            if(write(fd, buf, len) == len) {
+            // one write may stop short of a large buffer
+            size_t done = 0;
+            ssize_t n;
+            while(done < len && (n = write(fd, buf + done, len - done)) > 0)
+                done += n;
+            if(done == len) {
                 close(fd);
                 free(buf);
                 E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
+                journalSaved();
+                if(D.on)
+                    diffLoad();
+                editorSetStatusMessage("%zu bytes written to disk", len);
                 return;
             }
         }
         close(fd);
     }
     free(buf);
+    if(D.on)
+        diffLoad();
     editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
@@ -676,91 +4210,1110 @@ void editorOpen(char *filename) {
     if(!fp)
         die("fopen");
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while((linelen = getline(&line, &linecap, fp)) != -1){
-        while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+    size_t cap = 1 << 16, len = 0, nread;
+    char *buf = malloc(cap);
+    while((nread = fread(buf + len, 1, cap - len, fp)) > 0) {
+        len += nread;
+        if(len == cap)
+            buf = realloc(buf, cap *= 2);
+    }
+    fclose(fp);
+
+    // rows go in OPEN_BATCH at a time, each batch a single shift and
+    // highlighting pass
+    struct textSpan *spans = malloc(sizeof(struct textSpan) * OPEN_BATCH);
+    int n = 0;
+    char *p = buf, *end = buf + len;
+    while(p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        int linelen = (nl ? nl : end) - p;
+        while(linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+        spans[n++] = (struct textSpan){NULL, p, linelen};
+        if(n == OPEN_BATCH) {
+            editorInsertRows(E.numrows, spans, n);
+            n = 0;
+        }
+        p = nl ? nl + 1 : end;
+    }
+    editorInsertRows(E.numrows, spans, n);
+
+    free(spans);
+    free(buf);
+    E.dirty = 0;
+}
+
+// Replaces the buffer with another file. The caller makes sure nothing
+// unsaved is lost.
+void editorSwitchFile(char *filename) {
+    if(access(filename, R_OK) == -1) {
+        editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+        return;
+    }
+    journalClose(1);
+    if(D.on)
+        editorToggleDiff();
+    editorDelRows(0, E.numrows);
+    E.cx = E.cy = 0;
+    E.rowoff = E.coloff = 0;
+    E.voff = 0;
+    E.sel_mode = SEL_NONE;
+    E.match_row = -1;
+    editorOpen(filename);
+    editorRecover();
+}
+
+/*** find ***/
+void editorFindCallback(char *query, int key) {
+	
+	static int last_match = -1;
+	static int direction = 1;
+
+	E.match_row = -1;
+
+	if(key == '\r' || key == '\x1b') {
+		last_match = -1;
+		direction = 1;
+		return;
+	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		direction = 1;
+	} else if (key == ARROW_LEFT || key == ARROW_UP) {
+		direction = -1;
+	} else {
+		last_match = -1;
+		direction = 1;
+	}
+	
+	if(last_match == -1)
+		direction = 1;
+	int current = last_match;
+	int i;
+    for(i = 0; i < E.numrows; i++){
+		current += direction;
+		if(current == -1)
+			current = E.numrows - 1;
+		else if(current == E.numrows)
+			current = 0;
+
+        erow *row = &E.row[current];
+        int qlen = strlen(query);
+        int match = editorRowFind(row, 0, query, qlen);
+        if(match != -1) {
+			last_match = current;
+            E.cy = current;
+            E.cx = match;
+            E.rowoff = E.numrows;
+
+            E.match_row = current;
+            E.match_start = row->rmap ? row->rmap[match] : match;
+            E.match_end = row->rmap ? row->rmap[match + qlen] : match + qlen;
+            break;
+		}
+	}
+}
+
+void editorFind(){
+	int saved_cx = E.cx;
+	int saved_cy = E.cy;
+	int saved_coloff = E.coloff;
+	int saved_rowoff = E.rowoff;
+
+	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+	if (query) {
+	  free(query);
+	} else {
+		E.cx = saved_cx;
+		E.cy = saved_cy;
+		E.coloff = saved_coloff;
+		E.rowoff = saved_rowoff;
+	}
+}
+
+/*** goto ***/
+
+void editorGoto() {
+    char *query = editorPrompt("Go to line: %s (:N for byte offset, ESC to cancel)", NULL);
+    if(query == NULL)
+        return;
+
+    if(query[0] == ':') {
+        long long offset = atoll(&query[1]);
+        long long total = editorRowOffset(E.numrows);
+        if(offset < 0)
+            offset = 0;
+        if(offset >= total) {
+            E.cy = E.numrows;
+            E.cx = 0;
+        } else {
+            E.cy = editorOffsetToRow(offset);
+            E.cx = offset - editorRowOffset(E.cy);
+            if(E.cx > E.row[E.cy].size)
+                E.cx = E.row[E.cy].size;
+            // an offset inside a multi-byte character goes to its start
+            E.cx = editorRowSnapCx(&E.row[E.cy], E.cx);
+        }
+    } else {
+        int line = atoi(query);
+        if(line < 1)
+            line = 1;
+        if(line > E.numrows)
+            line = E.numrows;
+        E.cy = line > 0 ? line - 1 : 0;
+        E.cx = 0;
+    }
+    free(query);
+
+    // center the target line if it is off screen
+    if(E.cy < E.rowoff || E.cy >= E.rowoff + E.screenrows) {
+        E.rowoff = E.cy - E.screenrows / 2;
+        if(E.rowoff < 0)
+            E.rowoff = 0;
+    }
+}
+
+/*** file finder ***/
+
+// Ctrl-O picks a file to open by fuzzy matching its path. The files under
+// the working directory are indexed at startup by a pool of threads that
+// take directories off a shared queue, and an inotify watch on every
+// directory keeps the index current afterwards. Each keystroke filters
+// the index: a mask of the characters in each path rules most of it out
+// at once, SSE2 compares look for the query's characters in order in the
+// rest, and only paths that have them all are scored.
+
+#define FINDER_ROWS 10              // results shown above the prompt
+#define FINDER_CHUNK 65536          // fewest paths worth a thread of their own
+#define FINDER_BLOCK (1 << 20)      // bytes of path text per arena block
+
+struct finderEntry {
+    char *path;                     // relative to the working directory
+    int len;
+    unsigned long long mask;        // finderMask of the path
+};
+
+struct finderHit {
+    int entry;
+    int score;
+};
+
+struct finder {
+    pthread_mutex_t lock;           // guards the index and the results
+    pthread_cond_t more;            // a directory was queued or a walker is done
+    struct finderEntry *entries;
+    int n, cap;
+    char *block;                    // arena block paths are copied into
+    size_t blockused;
+    int gen;                        // bumped when entries move
+    char **queue;                   // directories waiting to be walked
+    int nqueue, qcap;
+    int busy;                       // walkers reading a directory
+    int indexing;
+    int inotify;
+    char **watch;                   // directory of each watch descriptor
+    int nwatch;
+
+    // results for the query, kept so that a longer query only filters them
+    int active;
+    char *query;
+    int *hits;                      // matching entries, in index order
+    int nhits;
+    int scanned;                    // entries the hits were taken from
+    int hitgen;
+    struct finderHit top[FINDER_ROWS];
+    int ntop;
+    int selected;                   // rank of the selected result
+    const char *picked;             // its path, which stays put in the arena
+};
+
+struct finder F = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .more = PTHREAD_COND_INITIALIZER,
+    .inotify = -1
+};
+
+static inline unsigned long long finderBit(unsigned char c) {
+    c = tolower(c);
+    if(c >= 'a' && c <= 'z')
+        return 1ull << (c - 'a');
+    if(c >= '0' && c <= '9')
+        return 1ull << (26 + c - '0');
+    return 1ull << (36 + c % 28);
+}
+
+// a bit for each character (folded to lower case) found in s
+unsigned long long finderMask(const char *s, int len) {
+    unsigned long long m = 0;
+    for(int i = 0; i < len; i++)
+        m |= finderBit(s[i]);
+    return m;
+}
+
+char *finderJoin(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s%s%s", dir, *dir ? "/" : "", name);
+    return path;
+}
+
+// Copies a path into the index. The caller holds F.lock. Blocks keep 16
+// bytes spare at the end so the matcher can read whole vectors past the
+// last path.
+void finderAdd(const char *path) {
+    int len = strlen(path);
+    if(F.block == NULL || F.blockused + len + 1 > FINDER_BLOCK) {
+        F.block = calloc(FINDER_BLOCK + 16, 1);
+        F.blockused = 0;
+    }
+    char *p = F.block + F.blockused;
+    memcpy(p, path, len + 1);
+    F.blockused += len + 1;
+    if(F.n == F.cap) {
+        F.cap = F.cap ? F.cap * 2 : 4096;
+        F.entries = realloc(F.entries, sizeof(struct finderEntry) * F.cap);
+    }
+    F.entries[F.n++] = (struct finderEntry){p, len, finderMask(p, len)};
+}
+
+// Drops a path from the index, or everything under it for a directory.
+// Its text stays in the arena. The caller holds F.lock.
+void finderRemove(const char *path, int isdir) {
+    int len = strlen(path);
+    for(int i = 0; i < F.n; ) {
+        struct finderEntry *e = &F.entries[i];
+        int hit = isdir ? e->len > len && e->path[len] == '/' && !memcmp(e->path, path, len)
+                        : e->len == len && !memcmp(e->path, path, len);
+        if(hit) {
+            *e = F.entries[--F.n];
+            F.gen++;
+        } else {
+            i++;
+        }
+    }
+}
+
+void finderWatch(const char *dir) {
+    if(F.inotify == -1)
+        return;
+    int wd = inotify_add_watch(F.inotify, *dir ? dir : ".",
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if(wd < 0)
+        return;
+    pthread_mutex_lock(&F.lock);
+    if(wd >= F.nwatch) {
+        int n = wd * 2 + 16;
+        F.watch = realloc(F.watch, sizeof(char *) * n);
+        memset(&F.watch[F.nwatch], 0, sizeof(char *) * (n - F.nwatch));
+        F.nwatch = n;
+    }
+    // a directory moved within the tree keeps its descriptor
+    free(F.watch[wd]);
+    F.watch[wd] = strdup(dir);
+    pthread_mutex_unlock(&F.lock);
+}
+
+// Indexes the files of a directory and watches it. Returns how many
+// subdirectories it has; their paths are left in *subdirs. Hidden entries
+// and symlinked directories are skipped.
+int finderReadDir(const char *dir, char ***subdirs) {
+    *subdirs = NULL;
+    DIR *d = opendir(*dir ? dir : ".");
+    if(d == NULL)
+        return 0;
+    finderWatch(dir);
+    char **files = NULL;
+    int nfiles = 0, nsub = 0, filecap = 0, subcap = 0;
+    struct dirent *de;
+    while((de = readdir(d)) != NULL) {
+        if(de->d_name[0] == '.')
+            continue;
+        char *path = finderJoin(dir, de->d_name);
+        int isdir = de->d_type == DT_DIR, isfile = de->d_type == DT_REG;
+        if(de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+            struct stat st;
+            if(stat(path, &st) == 0) {
+                isdir = S_ISDIR(st.st_mode) && de->d_type == DT_UNKNOWN;
+                isfile = S_ISREG(st.st_mode);
+            }
+        }
+        if(isdir) {
+            if(nsub == subcap) {
+                subcap = subcap ? subcap * 2 : 16;
+                *subdirs = realloc(*subdirs, sizeof(char *) * subcap);
+            }
+            (*subdirs)[nsub++] = path;
+        } else if(isfile) {
+            if(nfiles == filecap) {
+                filecap = filecap ? filecap * 2 : 64;
+                files = realloc(files, sizeof(char *) * filecap);
+            }
+            files[nfiles++] = path;
+        } else {
+            free(path);
+        }
+    }
+    closedir(d);
+
+    pthread_mutex_lock(&F.lock);
+    for(int i = 0; i < nfiles; i++)
+        finderAdd(files[i]);
+    pthread_mutex_unlock(&F.lock);
+    for(int i = 0; i < nfiles; i++)
+        free(files[i]);
+    free(files);
+    return nsub;
+}
+
+void *finderWalker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&F.lock);
+    while(1) {
+        while(F.nqueue == 0 && F.busy > 0)
+            pthread_cond_wait(&F.more, &F.lock);
+        if(F.nqueue == 0)
+            break;
+        char *dir = F.queue[--F.nqueue];
+        F.busy++;
+        pthread_mutex_unlock(&F.lock);
+
+        char **sub;
+        int nsub = finderReadDir(dir, &sub);
+        free(dir);
+
+        pthread_mutex_lock(&F.lock);
+        if(F.nqueue + nsub > F.qcap) {
+            F.qcap = F.qcap * 2 > F.nqueue + nsub ? F.qcap * 2 : F.nqueue + nsub;
+            F.queue = realloc(F.queue, sizeof(char *) * F.qcap);
+        }
+        if(nsub > 0)
+            memcpy(&F.queue[F.nqueue], sub, sizeof(char *) * nsub);
+        F.nqueue += nsub;
+        free(sub);
+        F.busy--;
+        pthread_cond_broadcast(&F.more);
+    }
+    pthread_mutex_unlock(&F.lock);
+    return NULL;
+}
+
+// Walks dir and everything under it on the calling thread.
+void finderWalkTree(char *dir) {
+    char **stack = malloc(sizeof(char *));
+    int n = 1;
+    stack[0] = strdup(dir);
+    while(n > 0) {
+        char *d = stack[--n];
+        char **sub;
+        int nsub = finderReadDir(d, &sub);
+        free(d);
+        stack = realloc(stack, sizeof(char *) * (n + nsub + 1));
+        memcpy(&stack[n], sub, sizeof(char *) * nsub);
+        n += nsub;
+        free(sub);
+    }
+    free(stack);
+}
+
+void finderEvent(struct inotify_event *ev) {
+    if(ev->mask & IN_IGNORED) {
+        pthread_mutex_lock(&F.lock);
+        // a directory removed right after it was watched can get here
+        // before its watch was recorded
+        if(ev->wd < F.nwatch) {
+            free(F.watch[ev->wd]);
+            F.watch[ev->wd] = NULL;
+        }
+        pthread_mutex_unlock(&F.lock);
+        return;
+    }
+    if(ev->len == 0 || ev->name[0] == '.')
+        return;
+    pthread_mutex_lock(&F.lock);
+    char *path = ev->wd < F.nwatch && F.watch[ev->wd] ? finderJoin(F.watch[ev->wd], ev->name) : NULL;
+    pthread_mutex_unlock(&F.lock);
+    if(path == NULL)
+        return;
+
+    struct stat st;
+    if(!(ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        pthread_mutex_lock(&F.lock);
+        finderRemove(path, ev->mask & IN_ISDIR);
+        pthread_mutex_unlock(&F.lock);
+    } else if(ev->mask & IN_ISDIR) {
+        finderWalkTree(path);
+    } else if(stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        pthread_mutex_lock(&F.lock);
+        finderAdd(path);
+        pthread_mutex_unlock(&F.lock);
+    }
+    free(path);
+}
+
+// Builds the index with a walker per CPU, then follows the changes.
+void *finderIndexer(void *arg) {
+    (void)arg;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus > 1 ? cpus : 1;
+    struct worker *tids = malloc(sizeof(struct worker) * nthreads);
+    for(int i = 1; i < nthreads; i++)
+        workerStart(&tids[i], finderWalker, NULL);
+    finderWalker(NULL);
+    for(int i = 1; i < nthreads; i++)
+        workerJoin(&tids[i]);
+    free(tids);
+    pthread_mutex_lock(&F.lock);
+    F.indexing = 0;
+    pthread_mutex_unlock(&F.lock);
+
+    if(F.inotify == -1)
+        return NULL;
+    _Alignas(struct inotify_event) char buf[4096];
+    ssize_t len;
+    while((len = read(F.inotify, buf, sizeof(buf))) > 0) {
+        for(char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            finderEvent(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+void editorIndexStart() {
+    F.inotify = inotify_init1(IN_CLOEXEC);
+    F.queue = malloc(sizeof(char *));
+    F.qcap = 1;
+    F.queue[F.nqueue++] = strdup("");
+    F.indexing = 1;
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, finderIndexer, NULL) == 0)
+        pthread_detach(tid);
+    else
+        F.indexing = 0;
+}
+
+// next byte at or after from equal to lo or up, -1 if none
+static inline int finderFind(const char *s, int from, int len, unsigned char lo, unsigned char up) {
+    int i = from;
+#ifdef __SSE2__
+    __m128i vlo = _mm_set1_epi8(lo), vup = _mm_set1_epi8(up);
+    for(; i < len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vlo), _mm_cmpeq_epi8(v, vup)));
+        if(m) {
+            i += __builtin_ctz(m);
+            return i < len ? i : -1;
+        }
+    }
+    return -1;
+#else
+    for(; i < len; i++)
+        if((unsigned char)s[i] == lo || (unsigned char)s[i] == up)
+            return i;
+    return -1;
+#endif
+}
+
+// Finds the query's characters in order, ignoring case, and leaves their
+// positions in pos. The earliest such match is then pulled towards its
+// end, which keeps it tight and favours the file name over directories.
+// Returns 0 if the path doesn't have them all.
+int finderMatch(const char *s, int len, const char *q, int qlen, int *pos) {
+    int at = 0;
+    for(int k = 0; k < qlen; k++) {
+        at = finderFind(s, at, len, tolower((unsigned char)q[k]), toupper((unsigned char)q[k]));
+        if(at < 0)
+            return 0;
+        pos[k] = at++;
+    }
+    for(int k = qlen - 2; k >= 0; k--) {
+        int c = tolower((unsigned char)q[k]);
+        for(int i = pos[k + 1] - 1; i > pos[k]; i--) {
+            if(tolower((unsigned char)s[i]) == c) {
+                pos[k] = i;
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+// Matched characters count most at the start of a path component or a
+// word, and right after the previous one; gaps and long paths cost a bit.
+int finderScore(const char *s, int len, const int *pos, int qlen) {
+    int base = len;
+    while(base > 0 && s[base - 1] != '/')
+        base--;
+    int score = -len / 4;
+    for(int k = 0; k < qlen; k++) {
+        int i = pos[k];
+        unsigned char prev = i ? s[i - 1] : '/';
+        score += 16;
+        if(prev == '/')
+            score += 24;
+        else if(strchr("_-. ", prev) || (islower(prev) && isupper((unsigned char)s[i])))
+            score += 16;
+        if(k > 0) {
+            int gap = i - pos[k - 1] - 1;
+            score += gap == 0 ? 12 : -(gap < 16 ? gap : 16);
+        }
+        if(i >= base)
+            score += 8;
+    }
+    return score;
+}
+
+// selects the result of rank k; the caller holds F.lock
+void finderPick(int k) {
+    F.selected = k > 0 && k < F.ntop ? k : 0;
+    F.picked = F.ntop ? F.entries[F.top[F.selected].entry].path : NULL;
+}
+
+// keeps the best FINDER_ROWS hits, best first
+void finderKeep(struct finderHit *top, int *ntop, struct finderHit hit) {
+    int i = *ntop < FINDER_ROWS ? (*ntop)++ : FINDER_ROWS;
+    while(i > 0 && top[i - 1].score < hit.score) {
+        if(i < FINDER_ROWS)
+            top[i] = top[i - 1];
+        i--;
+    }
+    if(i < FINDER_ROWS)
+        top[i] = hit;
+}
+
+struct finderJob {
+    const int *idx;             // candidates, or NULL for entries lo .. hi - 1
+    int lo, hi;
+    const char *query;
+    int qlen;
+    int *hits;
+    int nhits;
+    struct finderHit top[FINDER_ROWS];
+    int ntop;
+};
+
+void *finderWorker(void *arg) {
+    struct finderJob *job = arg;
+    unsigned long long qmask = finderMask(job->query, job->qlen);
+    int *pos = malloc(sizeof(int) * (job->qlen + 1));
+    for(int i = job->lo; i < job->hi; i++) {
+        int e = job->idx ? job->idx[i] : i;
+        struct finderEntry *entry = &F.entries[e];
+        if((entry->mask & qmask) != qmask)
+            continue;
+        if(!finderMatch(entry->path, entry->len, job->query, job->qlen, pos))
+            continue;
+        job->hits[job->nhits++] = e;
+        struct finderHit hit = {e, finderScore(entry->path, entry->len, pos, job->qlen)};
+        finderKeep(job->top, &job->ntop, hit);
+    }
+    free(pos);
+    return NULL;
+}
+
+// Recomputes the hits and the best of them for the query, from the last
+// hits when the query only grew and no entry has moved since. The caller
+// holds F.lock.
+void finderFilter(const char *query) {
+    int *cand = NULL, ncand = F.n;
+    if(F.query && F.hitgen == F.gen && !strncmp(query, F.query, strlen(F.query))) {
+        ncand = F.nhits + F.n - F.scanned;
+        cand = malloc(sizeof(int) * (ncand ? ncand : 1));
+        memcpy(cand, F.hits, sizeof(int) * F.nhits);
+        for(int i = F.scanned; i < F.n; i++)
+            cand[F.nhits + i - F.scanned] = i;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncand / FINDER_CHUNK;
+    if(nthreads > cpus)
+        nthreads = cpus;
+    if(nthreads < 1)
+        nthreads = 1;
+    struct finderJob *jobs = malloc(sizeof(struct finderJob) * nthreads);
+    struct worker *tids = malloc(sizeof(struct worker) * nthreads);
+    int *hits = malloc(sizeof(int) * (ncand ? ncand : 1));
+    for(int i = 0; i < nthreads; i++) {
+        int lo = (long long)ncand * i / nthreads, hi = (long long)ncand * (i + 1) / nthreads;
+        jobs[i] = (struct finderJob){cand, lo, hi, query, strlen(query), &hits[lo], 0, {{0, 0}}, 0};
+        if(i > 0)
+            workerStart(&tids[i], finderWorker, &jobs[i]);
+    }
+    finderWorker(&jobs[0]);
+    for(int i = 1; i < nthreads; i++)
+        workerJoin(&tids[i]);
+
+    // the hits of each slice close up behind the ones before
+    F.nhits = 0;
+    F.ntop = 0;
+    for(int i = 0; i < nthreads; i++) {
+        memmove(&hits[F.nhits], jobs[i].hits, sizeof(int) * jobs[i].nhits);
+        F.nhits += jobs[i].nhits;
+        for(int k = 0; k < jobs[i].ntop; k++)
+            finderKeep(F.top, &F.ntop, jobs[i].top[k]);
+    }
+    free(F.hits);
+    F.hits = hits;
+    F.scanned = F.n;
+    F.hitgen = F.gen;
+    if(query != F.query) {
+        free(F.query);
+        F.query = strdup(query);
+    }
+    // the selection follows its entry to its new rank, if it still has one
+    int k = F.ntop - 1;
+    while(k > 0 && F.entries[F.top[k].entry].path != F.picked)
+        k--;
+    finderPick(k);
+    free(cand);
+    free(jobs);
+    free(tids);
+}
+
+// The results above the prompt, best at the bottom.
+void editorDrawFinder(struct abuf *ab) {
+    if(!F.active)
+        return;
+    pthread_mutex_lock(&F.lock);
+    // catch up with what the index thread did since the last key
+    if(F.hitgen != F.gen || F.scanned != F.n)
+        finderFilter(F.query);
+    int rows = F.ntop + 1 < E.screenrows ? F.ntop + 1 : E.screenrows;
+    char buf[64];
+    for(int y = 0; y < rows; y++) {
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows - rows + y + 1);
+        abAppend(ab, buf, len);
+        int k = rows - 1 - y;       // rank shown on this line, the top line counts
+        if(k == F.ntop) {
+            len = snprintf(buf, sizeof(buf), "  %d/%d%s", F.nhits, F.n, F.indexing ? " (indexing)" : "");
+            abAppend(ab, "\x1b[7m", 4);
+            abAppend(ab, buf, len < E.screencols ? len : E.screencols);
+            abAppend(ab, "\x1b[K\x1b[m", 6);
+            continue;
+        }
+        struct finderEntry *e = &F.entries[F.top[k].entry];
+        int plen = e->len < E.screencols - 2 ? e->len : E.screencols - 2;
+        while(plen > 0 && plen < e->len && UTF8_CONT(e->path[plen]))
+            plen--;
+        abAppend(ab, k == F.selected ? "\x1b[7m> " : "  ", k == F.selected ? 6 : 2);
+        abAppendPrintable(ab, e->path, plen);
+        abAppend(ab, "\x1b[K\x1b[m", 6);
+    }
+    pthread_mutex_unlock(&F.lock);
+}
+
+void editorFinderCallback(char *query, int key) {
+    pthread_mutex_lock(&F.lock);
+    if(key == ARROW_UP) {
+        if(F.selected + 1 < F.ntop)
+            finderPick(F.selected + 1);
+    } else if(key == ARROW_DOWN) {
+        if(F.selected > 0)
+            finderPick(F.selected - 1);
+    } else if(key != '\r' && key != '\x1b') {
+        finderFilter(query);
+        finderPick(0);
+    }
+    pthread_mutex_unlock(&F.lock);
+}
+
+void editorFinder() {
+    if(E.dirty) {
+        editorSetStatusMessage("Save the changes to %s first (Ctrl-S)", E.filename ? E.filename : "[No Name]");
+        return;
+    }
+    pthread_mutex_lock(&F.lock);
+    finderFilter("");
+    finderPick(0);
+    F.active = 1;
+    pthread_mutex_unlock(&F.lock);
+
+    char *query = editorPrompt("Open: %s (Up/Down to choose, ESC to cancel)", editorFinderCallback);
+
+    pthread_mutex_lock(&F.lock);
+    F.active = 0;
+    // what was highlighted, even if the index moved on since
+    char *path = query && F.picked ? strdup(F.picked) : NULL;
+    pthread_mutex_unlock(&F.lock);
+    free(query);
+    if(path) {
+        editorSwitchFile(path);
+        free(path);
+    }
+}
+
+/*** project grep ***/
+
+// Ctrl-T searches every file in the finder's index for a literal string.
+// The files are shared out between a pool of threads; one that runs out
+// steals half of what is left to another, so a few big files don't hold
+// up the rest. Each file is mapped and scanned with SSE2 compares of the
+// first and last byte of the string. Hits are listed above the prompt
+// as they come in and each keystroke restarts the search, cancelling the
+// one still running.
+
+#define GREP_MAX_HITS 10000
+#define GREP_TEXT 256               // bytes of a hit's line kept for display
+#define GREP_CANCEL_BYTES (1 << 20) // scanned between checks for a cancel
+
+struct grepHit {
+    const char *path;
+    int line;                       // 1-based
+    int col;                        // byte offset in the line
+    char *text;
+};
+
+// the files one thread still has to search, files[lo .. hi - 1]
+struct grepQueue {
+    pthread_mutex_t lock;
+    int lo, hi;
+};
+
+struct projectGrep {
+    pthread_mutex_t lock;           // guards the hits
+    struct grepHit *hits;
+    int nhits, cap;
+    int filesdone;
+    int truncated;                  // stopped at GREP_MAX_HITS
+    const char **files;
+    int nfiles;
+    char *query;
+    int qlen;
+    struct grepQueue *queues;
+    struct worker *tids;
+    int nthreads;
+    int nostart;                    // no search thread could be started
+    atomic_int live;                // threads still searching
+    atomic_int cancel;
+    int active;
+    int selected;
+    int top;                        // first hit shown
+    int shown, shown_live;          // what the last frame showed
+};
+
+struct projectGrep P = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// First occurrence of q in s[0 .. len - 1], or NULL. Candidates are the
+// positions where both the first and the last byte of q match.
+const char *grepFind(const char *s, size_t len, const char *q, int qlen) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(q[0]), last = _mm_set1_epi8(q[qlen - 1]);
+    for(; i + qlen - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + qlen - 1));
+        int m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while(m) {
+            int k = __builtin_ctz(m);
+            if(!memcmp(s + i + k + 1, q + 1, qlen - 1))
+                return s + i + k;
+            m &= m - 1;
+        }
+    }
+#endif
+    if(i >= len)
+        return NULL;
+    return memmem(s + i, len - i, q, qlen);
+}
+
+// Next file for thread self to search, or -1 once every queue is empty.
+int grepTake(int self) {
+    struct grepQueue *own = &P.queues[self];
+    pthread_mutex_lock(&own->lock);
+    int f = own->lo < own->hi ? own->lo++ : -1;
+    pthread_mutex_unlock(&own->lock);
+    if(f != -1)
+        return f;
+
+    for(int k = 1; k < P.nthreads; k++) {
+        struct grepQueue *victim = &P.queues[(self + k) % P.nthreads];
+        pthread_mutex_lock(&victim->lock);
+        int lo = victim->lo + (victim->hi - victim->lo) / 2, hi = victim->hi;
+        victim->hi = lo;
+        pthread_mutex_unlock(&victim->lock);
+        if(lo < hi) {
+            // nobody steals from an empty queue, so this one is still ours
+            pthread_mutex_lock(&own->lock);
+            own->lo = lo + 1;
+            own->hi = hi;
+            pthread_mutex_unlock(&own->lock);
+            return lo;
+        }
+    }
+    return -1;
+}
+
+// Searches one file, one hit per line, and adds its hits in one go. The
+// file is read into the searcher's buffer, *data of *cap bytes; a mapping
+// would fault if another program truncated the file during the scan.
+void grepFile(const char *path, char **data, size_t *cap) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd == -1)
+        return;
+    if(fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    if((size_t)st.st_size > *cap) {
+        free(*data);
+        *cap = st.st_size;
+        *data = malloc(*cap);
+    }
+    size_t len = 0;
+    ssize_t n;
+    while(len < (size_t)st.st_size && (n = read(fd, *data + len, st.st_size - len)) > 0)
+        len += n;
+    close(fd);
+    if(len == 0)
+        return;
+
+    struct grepHit *hits = NULL;
+    int nhits = 0;
+    // a NUL near the start means a binary file, as for grep
+    if(memchr(*data, '\0', len < 8192 ? len : 8192) == NULL) {
+        const char *p = *data, *end = *data + len, *counted = *data;
+        int line = 1;
+        while(p < end && !atomic_load(&P.cancel)) {
+            // matches starting in the next span, which may end past it
+            size_t left = end - p, span = left < GREP_CANCEL_BYTES ? left : GREP_CANCEL_BYTES;
+            size_t window = span + P.qlen - 1 < left ? span + P.qlen - 1 : left;
+            const char *m = grepFind(p, window, P.query, P.qlen);
+            if(m == NULL) {
+                p += span;
+                continue;
+            }
+            const char *nl;
+            while((nl = memchr(counted, '\n', m - counted)) != NULL) {
+                line++;
+                counted = nl + 1;
+            }
+            const char *eol = memchr(m, '\n', end - m);
+            if(eol == NULL)
+                eol = end;
+            const char *text = counted;
+            while(text < m && (*text == ' ' || *text == '\t'))
+                text++;
+            int tlen = eol - text < GREP_TEXT ? eol - text : GREP_TEXT;
+            hits = realloc(hits, sizeof(struct grepHit) * (nhits + 1));
+            hits[nhits++] = (struct grepHit){path, line, m - counted, strndup(text, tlen)};
+            p = eol;
+        }
+    }
+
+    pthread_mutex_lock(&P.lock);
+    if(P.nhits + nhits > GREP_MAX_HITS) {
+        for(int i = GREP_MAX_HITS - P.nhits; i < nhits; i++)
+            free(hits[i].text);
+        nhits = GREP_MAX_HITS - P.nhits;
+        P.truncated = 1;
+        atomic_store(&P.cancel, 1);
+    }
+    if(P.nhits + nhits > P.cap) {
+        P.cap = P.cap * 2 > P.nhits + nhits ? P.cap * 2 : P.nhits + nhits;
+        P.hits = realloc(P.hits, sizeof(struct grepHit) * P.cap);
     }
+    if(nhits > 0)
+        memcpy(&P.hits[P.nhits], hits, sizeof(struct grepHit) * nhits);
+    P.nhits += nhits;
+    P.filesdone++;
+    pthread_mutex_unlock(&P.lock);
+    free(hits);
+}
 
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+void *grepSearcher(void *arg) {
+    int self = (int)(intptr_t)arg;
+    char *data = NULL;
+    size_t cap = 0;
+    int f;
+    while(!atomic_load(&P.cancel) && (f = grepTake(self)) != -1)
+        grepFile(P.files[f], &data, &cap);
+    free(data);
+    atomic_fetch_sub(&P.live, 1);
+    return NULL;
 }
 
-/*** find ***/
-void editorFindCallback(char *query, int key) {
-	
-	static int last_match = -1;
-	static int direction = 1;
+// Cancels a running search and waits for its threads.
+void grepStop() {
+    if(P.tids == NULL)
+        return;
+    atomic_store(&P.cancel, 1);
+    for(int i = 0; i < P.nthreads; i++)
+        workerJoin(&P.tids[i]);
+    for(int i = 0; i < P.nthreads; i++)
+        pthread_mutex_destroy(&P.queues[i].lock);
+    free(P.tids);
+    free(P.queues);
+    P.tids = NULL;
+    P.queues = NULL;
+}
 
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
+void grepClear() {
+    grepStop();
+    for(int i = 0; i < P.nhits; i++)
+        free(P.hits[i].text);
+    free(P.hits);
+    free(P.files);
+    free(P.query);
+    P.hits = NULL;
+    P.files = NULL;
+    P.query = NULL;
+    P.nhits = P.cap = P.nfiles = P.filesdone = P.truncated = P.nostart = 0;
+    P.selected = P.top = 0;
+}
 
-	if(saved_hl) {
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
-	}	
+void grepStart(const char *query) {
+    grepClear();
+    P.query = strdup(query);
+    P.qlen = strlen(query);
+    if(P.qlen == 0)
+        return;
 
-	if(key == '\r' || key == '\x1b') {
-		last_match = -1;
-		direction = 1;
-		return;
-	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
-	} else if (key == ARROW_LEFT || key == ARROW_UP) {
-		direction = -1;
-	} else {
-		last_match = -1;
-		direction = 1;
-	}
-	
-	if(last_match == -1)
-		direction = 1;
-	int current = last_match;
-	int i;
-    for(i = 0; i < E.numrows; i++){
-		current += direction;
-		if(current == -1)
-			current = E.numrows - 1;
-		else if(current == E.numrows)
-			current = 0;
+    // paths stay in the finder's arena even after their entry goes, so
+    // the pointers outlive any change to the index during the search
+    pthread_mutex_lock(&F.lock);
+    P.nfiles = F.n;
+    P.files = malloc(sizeof(char *) * (F.n ? F.n : 1));
+    for(int i = 0; i < F.n; i++)
+        P.files[i] = F.entries[i].path;
+    pthread_mutex_unlock(&F.lock);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    P.nthreads = cpus > 1 ? cpus : 1;
+    P.queues = malloc(sizeof(struct grepQueue) * P.nthreads);
+    P.tids = malloc(sizeof(struct worker) * P.nthreads);
+    for(int i = 0; i < P.nthreads; i++) {
+        pthread_mutex_init(&P.queues[i].lock, NULL);
+        P.queues[i].lo = (long long)P.nfiles * i / P.nthreads;
+        P.queues[i].hi = (long long)P.nfiles * (i + 1) / P.nthreads;
+    }
+    atomic_store(&P.cancel, 0);
+    atomic_store(&P.live, P.nthreads);
+    // a searcher that can't be started leaves its files to the others to
+    // steal; the search never runs here, where it couldn't be cancelled
+    int started = 0;
+    for(int i = 0; i < P.nthreads; i++) {
+        struct worker *w = &P.tids[i];
+        w->started = pthread_create(&w->tid, NULL, grepSearcher, (void *)(intptr_t)i) == 0;
+        if(w->started)
+            started++;
+        else
+            atomic_fetch_sub(&P.live, 1);
+    }
+    P.nostart = started == 0;
+}
 
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if(match) {
-			last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-			
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-		}
-	}
+// The hits above the prompt, with a line counting them.
+void editorDrawGrep(struct abuf *ab) {
+    if(!P.active)
+        return;
+    pthread_mutex_lock(&P.lock);
+    int live = atomic_load(&P.live);
+    int rows = E.screenrows / 2;
+    int n = P.nhits < rows - 1 ? P.nhits : rows - 1;
+    if(P.selected < P.top)
+        P.top = P.selected;
+    if(P.selected >= P.top + n)
+        P.top = P.selected - n + 1;
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[7m", E.screenrows - n);
+    abAppend(ab, buf, len);
+    len = snprintf(buf, sizeof(buf), "  %d hits in %d/%d files%s", P.nhits, P.filesdone, P.nfiles,
+                   P.truncated ? " (stopped)" : P.nostart ? " (can't start a search thread)" :
+                   live ? " (searching)" : "");
+    abAppend(ab, buf, len < E.screencols ? len : E.screencols);
+    abAppend(ab, "\x1b[K\x1b[m", 6);
+    for(int y = 0; y < n; y++) {
+        struct grepHit *h = &P.hits[P.top + y];
+        int sel = P.top + y == P.selected;
+        abAppend(ab, "\r\n", 2);
+        abAppend(ab, sel ? "\x1b[7m> " : "  ", sel ? 6 : 2);
+        int room = E.screencols - 2;
+        int full = strlen(h->path), plen = full < room ? full : room;
+        while(plen > 0 && plen < full && UTF8_CONT(h->path[plen]))
+            plen--;
+        abAppendPrintable(ab, h->path, plen);
+        room -= plen;
+        len = snprintf(buf, sizeof(buf), ":%d: ", h->line);
+        if(len > room)
+            len = room;
+        abAppend(ab, buf, len);
+        room -= len;
+        int tlen = strlen(h->text);
+        if(tlen > room)
+            tlen = room;
+        while(tlen > 0 && tlen < (int)strlen(h->text) && UTF8_CONT(h->text[tlen]))
+            tlen--;
+        for(int i = 0; i < tlen; i++) {
+            char c = (unsigned char)h->text[i] < 0x20 || h->text[i] == 0x7f ? ' ' : h->text[i];
+            abAppend(ab, &c, 1);
+        }
+        abAppend(ab, "\x1b[K\x1b[m", 6);
+    }
+    P.shown = P.nhits;
+    P.shown_live = live;
+    pthread_mutex_unlock(&P.lock);
 }
 
-void editorFind(){
-	int saved_cx = E.cx;
-	int saved_cy = E.cy;
-	int saved_coloff = E.coloff;
-	int saved_rowoff = E.rowoff;
+// Redraws while waiting for a key if hits came in since the last frame.
+void editorGrepIdle() {
+    pthread_mutex_lock(&P.lock);
+    int same = P.nhits == P.shown && atomic_load(&P.live) == P.shown_live;
+    pthread_mutex_unlock(&P.lock);
+    if(same)
+        return;
+    // keep the prompt from timing out while results arrive
+    E.statusmsg_time = time(NULL);
+    editorRefreshScreen();
+}
 
-	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-	if (query) {
-	  free(query);
-	} else {
-		E.cx = saved_cx;
-		E.cy = saved_cy;
-		E.coloff = saved_coloff;
-		E.rowoff = saved_rowoff;
-	}
+void editorGrepCallback(char *query, int key) {
+    if(key == ARROW_UP || key == ARROW_DOWN) {
+        pthread_mutex_lock(&P.lock);
+        P.selected += key == ARROW_UP ? -1 : 1;
+        if(P.selected >= P.nhits)
+            P.selected = P.nhits - 1;
+        if(P.selected < 0)
+            P.selected = 0;
+        pthread_mutex_unlock(&P.lock);
+    } else if(key == '\x1b') {
+        grepStop();
+    } else if(key != '\r' && strcmp(query, P.query ? P.query : "")) {
+        grepStart(query);
+    }
+}
+
+void editorProjectGrep() {
+    P.active = 1;
+    E.idle = editorGrepIdle;
+    char *query = editorPrompt("Grep: %s (Up/Down to choose, Enter to open, ESC to cancel)",
+                               editorGrepCallback);
+    E.idle = NULL;
+    P.active = 0;
+    grepStop();
+
+    struct grepHit hit = {NULL, 0, 0, NULL};
+    if(query && P.nhits > 0)
+        hit = P.hits[P.selected];
+    char *path = hit.path ? strdup(hit.path) : NULL;
+    grepClear();
+    free(query);
+    if(path == NULL)
+        return;
+
+    if(E.filename == NULL || strcmp(path, E.filename)) {
+        if(E.dirty) {
+            editorSetStatusMessage("Save the changes to %s first (Ctrl-S)", E.filename ? E.filename : "[No Name]");
+            free(path);
+            return;
+        }
+        editorSwitchFile(path);
+    }
+    int opened = E.filename && !strcmp(path, E.filename);
+    free(path);
+    if(!opened || E.numrows == 0)
+        return;
+    E.cy = hit.line - 1 < E.numrows ? hit.line - 1 : E.numrows - 1;
+    E.cx = hit.col <= E.row[E.cy].size ? hit.col : E.row[E.cy].size;
+    E.rowoff = E.numrows;
 }
 
 /*** input ***/
@@ -777,8 +5330,11 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
         int c = editorReadKey();
         if(c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            while (buflen != 0 && UTF8_CONT(buf[buflen - 1]))
+                buflen--;
             if (buflen != 0)
-                buf[--buflen] = '\0';
+                buflen--;
+            buf[buflen] = '\0';
         } else if (c == '\x1b') {
             editorSetStatusMessage("");
    			if (callback)
@@ -792,13 +5348,16 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 					callback(buf, c);
                 return buf;
             }
-        } else if(!iscntrl(c) && c < 128) {
-            if(buflen == bufsize - 1) {
+        } else if(c < 256 && !iscntrl(c)) {
+            char ch[4];
+            int len = c < 128 ? (ch[0] = c, 1) : editorReadUtf8(c, ch);
+            while(buflen + len >= bufsize) {
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
             }
 
-            buf[buflen++] = c;
+            memcpy(&buf[buflen], ch, len);
+            buflen += len;
             buf[buflen] = '\0';
         }
 		if (callback)
@@ -806,13 +5365,99 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     }
 }
 
+// Puts the cursor on visual line v, at screen column col or the end of
+// the line when it is shorter.
+void editorWrapSetCursor(long long v, int col) {
+    long long last = editorRowVline(E.numrows);
+    if(v < 0)
+        v = 0;
+    if(v > last)
+        v = last;
+    E.cy = editorVlineToRow(v);
+    if(E.cy >= E.numrows) {
+        E.cx = 0;
+        return;
+    }
+    erow *row = &E.row[E.cy];
+    int k = v - editorRowVline(E.cy);
+    int start = editorRowWrapStart(row, k), end = editorRowWrapEnd(row, k);
+    E.cx = editorRowRxToCx(row, (row->rcol ? row->rcol[start] : start) + col);
+    // zero width marks at the start of the line belong to the line before
+    int r = row->rmap ? row->rmap[E.cx] : E.cx;
+    if(r < start)
+        E.cx = editorRowRToCx(row, start);
+    // and past the end of a line that isn't the row's last is the next line
+    else if(k + 1 < row->nwraps && r >= end)
+        E.cx = editorRowPrevCx(row, editorRowRToCx(row, end));
+}
+
+// Moves the cursor n visual lines up or down, to the same column where
+// the line is long enough.
+void editorWrapMoveCursor(int n) {
+    int col;
+    long long v = editorWrapCursor(&col) + n;
+    editorWrapSetCursor(v, col);
+}
+
+// Scrolls the view n lines down, or up when negative, keeping the cursor
+// where it is unless that leaves it off screen.
+void editorScrollView(int n) {
+    if(E.wrap) {
+        long long max = editorRowVline(E.numrows) + 1 - E.screenrows;
+        long long off = E.voff + n;
+        if(off > max)
+            off = max;
+        if(off < 0)
+            off = 0;
+        E.voff = off;
+        int col;
+        long long v = editorWrapCursor(&col);
+        if(v < off)
+            editorWrapSetCursor(off, col);
+        else if(v >= off + E.screenrows)
+            editorWrapSetCursor(off + E.screenrows - 1, col);
+        return;
+    }
+    int off = E.rowoff + n;
+    if(off > E.numrows + 1 - E.screenrows)
+        off = E.numrows + 1 - E.screenrows;
+    if(off < 0)
+        off = 0;
+    E.rowoff = off;
+    if(E.cy < off)
+        E.cy = off;
+    if(E.cy >= off + E.screenrows)
+        E.cy = off + E.screenrows - 1;
+    erow *row = E.cy < E.numrows ? &E.row[E.cy] : NULL;
+    if(E.cx > (row ? row->size : 0))
+        E.cx = row ? row->size : 0;
+    if(row)
+        E.cx = editorRowSnapCx(row, E.cx);
+}
+
+// Moves the cursor to the character drawn at text column x, screen row y.
+void editorMouseClick(int x, int y) {
+    if(y >= E.screenrows)
+        return;
+    if(x < 0)
+        x = 0;
+    if(E.wrap) {
+        editorWrapSetCursor(E.voff + y, x);
+        return;
+    }
+    E.cy = E.rowoff + y;
+    if(E.cy > E.numrows)
+        E.cy = E.numrows;
+    E.cx = E.cy < E.numrows ? editorRowRxToCx(&E.row[E.cy], E.coloff + x) : 0;
+}
+
 void editorMoveCursor(int key){
     erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
 
     switch(key){
         case ARROW_LEFT:
             if(E.cx != 0){
-                E.cx--;
+                E.cx = editorRowPrevCx(row, E.cx);
             } else if(E.cy > 0){
                 E.cy--;
                 E.cx = E.row[E.cy].size;
@@ -820,19 +5465,23 @@ void editorMoveCursor(int key){
             break;
         case ARROW_RIGHT:
             if(row && E.cx < row->size){
-                E.cx++;
+                E.cx = editorRowNextCx(row, E.cx);
             } else if(row && E.cx == row->size){
                 E.cy++;
                 E.cx = 0;
             }
             break;
         case ARROW_UP:
-            if(E.cy != 0){
+            if(E.wrap)
+                editorWrapMoveCursor(-1);
+            else if(E.cy != 0){
                 E.cy--;
             }
             break;
         case ARROW_DOWN:
-            if(E.cy < E.numrows){
+            if(E.wrap)
+                editorWrapMoveCursor(1);
+            else if(E.cy < E.numrows){
                 E.cy++;
             }
             break;
@@ -843,11 +5492,15 @@ void editorMoveCursor(int key){
     if(E.cx > rowlen){
         E.cx = rowlen;
     }
+    // don't leave the cursor inside a multi-byte character
+    if(row)
+        E.cx = editorRowSnapCx(row, E.cx);
 }
 
 void editorProcessKeypress(){
     static int quit_times = QUIT_TIMES;
     int c = editorReadKey();
+    E.stats = (struct editorStats){0, 0};
     switch(c){
         case '\r':
             editorInsertNewline();
@@ -860,6 +5513,7 @@ void editorProcessKeypress(){
                 quit_times--;
                 return;
             }
+            journalClose(1);
             write(STDOUT_FILENO, "\x1b[2J",4);  
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -889,20 +5543,79 @@ void editorProcessKeypress(){
 		case CTRL_KEY('f'):
 			editorFind();
 			break;    
+
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+
+        case CTRL_KEY('b'):
+            editorSelectStart(SEL_LINES);
+            break;
+
+        case CTRL_KEY('r'):
+            editorSelectStart(SEL_BLOCK);
+            break;
+
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+            editorCopy(c == CTRL_KEY('x'));
+            break;
+
+        case CTRL_KEY('v'):
+            editorPaste();
+            break;
+
+        case CTRL_KEY('w'):
+            editorToggleWrap();
+            break;
+
+        case CTRL_KEY('e'):
+            editorLineCommand();
+            break;
+
+        case CTRL_KEY('d'):
+            editorToggleDiff();
+            break;
+
+        case CTRL_KEY('o'):
+            editorFinder();
+            break;
+
+        case CTRL_KEY('t'):
+            editorProjectGrep();
+            break;
+
+        case CTRL_KEY('n'):
+            editorComplete();
+            break;
+
+        case CTRL_KEY('p'):
+#ifdef TEDIT_PROFILE
+            E.prof.hud = !E.prof.hud;
+#else
+            editorSetStatusMessage("Profiling is not compiled in (make profile)");
+#endif
+            break;
         
         case PAGE_UP:
         case PAGE_DOWN:
             {
+                if(E.wrap) {
+                    editorWrapMoveCursor(c == PAGE_UP ? -E.screenrows : E.screenrows);
+                    break;
+                }
                 if(c == PAGE_UP) {
-                    E.cy = E.rowoff;
+                    E.cy = E.rowoff - E.screenrows;
+                    if(E.cy < 0)
+                        E.cy = 0;
                 } else if (c == PAGE_DOWN) {
-                    E.cy = E.rowoff + E.screenrows - 1;
+                    E.cy = E.rowoff + 2 * E.screenrows - 1;
                     if(E.cy > E.numrows)
                         E.cy = E.numrows; 
                 }
-                int times = E.screenrows;
-                while(times--)
-                    editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+                int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+                if(E.cx > rowlen)
+                    E.cx = rowlen;
             }
             break;
 
@@ -913,8 +5626,24 @@ void editorProcessKeypress(){
             editorMoveCursor(c);
             break;
         
-        case CTRL_KEY('l'):
         case '\x1b':
+            E.sel_mode = SEL_NONE;
+            break;
+
+        case MOUSE_WHEEL_UP:
+        case MOUSE_WHEEL_DOWN:
+            editorScrollView(editorReadWheel(c) * WHEEL_LINES);
+            E.scroll_only = 1;
+            break;
+
+        case MOUSE_CLICK:
+            editorMouseClick(E.mouse_x - E.gutter, E.mouse_y);
+            break;
+
+        case MOUSE_EVENT:
+            break;
+
+        case CTRL_KEY('l'):
             break;
 
         default:
@@ -925,6 +5654,82 @@ void editorProcessKeypress(){
     quit_times = QUIT_TIMES;
 }
 
+#ifdef TEDIT_PROFILE
+// Ticks are TSC cycles where available; measure how many make up a
+// microsecond so the HUD can show times.
+void perfCalibrate() {
+    struct timespec a, b, pause = {0, 20000000};
+    unsigned long long t0 = perfNow();
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    nanosleep(&pause, NULL);
+    unsigned long long t1 = perfNow();
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    double us = (b.tv_sec - a.tv_sec) * 1e6 + (b.tv_nsec - a.tv_nsec) / 1e3;
+    E.prof.ticks_per_us = us > 0 ? (t1 - t0) / us : 1;
+}
+
+double perfMicros(unsigned long long ticks) {
+    return ticks / E.prof.ticks_per_us;
+}
+
+void editorDrawProfile(struct abuf *ab) {
+    if(!E.prof.hud)
+        return;
+    struct perfFrame *f = &E.prof.last;
+    static const char *times[] = {"input", "scroll", "draw", "syntax", "write"};
+    char lines[PERF_SLOTS + 6][32];
+    int n = 0;
+    // every line is 25 columns wide
+    snprintf(lines[n++], 32, " %-8s%12ld    ", "frame", E.prof.frames);
+    for(int slot = 0; slot < PERF_SLOTS; slot++)
+        snprintf(lines[n++], 32, " %-8s%12.1f us ", times[slot], perfMicros(f->ticks[slot]));
+    snprintf(lines[n++], 32, " %-8s%12ld    ", "allocs", f->allocs);
+    snprintf(lines[n++], 32, " %-8s%12ld    ", "rows hl", f->rows_highlighted);
+    snprintf(lines[n++], 32, " %-8s%12ld B  ", "written", f->bytes_written);
+    snprintf(lines[n++], 32, " %-8s%12ld B  ", "rendered", E.stats.rendered);
+    snprintf(lines[n++], 32, " %-8s%12ld B  ", "re-hl", E.stats.highlighted);
+
+    int width = 25;
+    int col = E.screencols - width + 1;
+    if(col < 1 || n > E.screenrows)
+        return;
+    for(int y = 0; y < n; y++) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[7m", y + 1, col);
+        abAppend(ab, buf, len);
+        abAppend(ab, lines[y], width);
+        abAppend(ab, "\x1b[m", 3);
+    }
+}
+
+// Publishes the frame just drawn to the HUD and the dump file, if any.
+void editorEndFrame() {
+    struct perfFrame *f = &E.prof.cur;
+    E.prof.frames++;
+    if(E.prof.dump) {
+        fprintf(E.prof.dump, "%ld,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%ld,%ld,%ld,%ld\n",
+                E.prof.frames, perfMicros(f->ticks[PERF_INPUT]),
+                perfMicros(f->ticks[PERF_SCROLL]), perfMicros(f->ticks[PERF_DRAW]),
+                perfMicros(f->ticks[PERF_SYNTAX]), perfMicros(f->ticks[PERF_WRITE]),
+                f->allocs, f->rows_highlighted, f->bytes_written,
+                E.stats.rendered, E.stats.highlighted);
+    }
+    E.prof.last = *f;
+    memset(f, 0, sizeof(*f));
+}
+
+void editorInitProfile() {
+    memset(&E.prof, 0, sizeof(E.prof));
+    perfCalibrate();
+    char *path = getenv("TEDIT_PERF_DUMP");
+    if(path && (E.prof.dump = fopen(path, "w")) != NULL) {
+        setvbuf(E.prof.dump, NULL, _IOFBF, 1 << 16);
+        fprintf(E.prof.dump, "frame,input_us,scroll_us,draw_us,syntax_us,write_us,"
+                "allocs,rows_highlighted,bytes_written,rendered,highlighted\n");
+    }
+}
+#endif
+
 /*** output ***/
 
 void editorScroll(){
@@ -933,6 +5738,18 @@ void editorScroll(){
         E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
     }
 
+    if(E.wrap) {
+        int col;
+        long long v = editorWrapCursor(&col);
+        if(v < E.voff)
+            E.voff = v;
+        if(v >= E.voff + E.screenrows)
+            E.voff = v - E.screenrows + 1;
+        E.rowoff = editorVlineToRow(E.voff);
+        E.coloff = 0;
+        return;
+    }
+
     if(E.cy < E.rowoff) {
         E.rowoff = E.cy;
     }
@@ -942,23 +5759,117 @@ void editorScroll(){
     if(E.rx < E.coloff){
         E.coloff = E.rx;
     }
-    if(E.rx >= E.coloff + E.screencols){
-        E.coloff = E.rx - E.screencols + 1;
+    if(E.rx >= E.coloff + editorTextCols()){
+        E.coloff = E.rx - editorTextCols() + 1;
+    }
+}
+
+
+// Draws render bytes start .. end - 1 of the row.
+void editorDrawRowSpan(struct abuf *ab, erow *row, int start, int end) {
+	char *c = row->render;
+	int current_color = -1;
+    int sel0 = -1, sel1 = -1;
+    if(editorRowSelection(row, &sel0, &sel1) && sel0 < start && start < sel1)
+        abAppend(ab, "\x1b[7m", 4);
+    int m0 = -1, m1 = -1;
+    if(row->idx == E.match_row) {
+        m0 = E.match_start;
+        m1 = E.match_end;
     }
+    int k = 0;
+    while(k < row->nctrl && row->ctrl[k] < start)
+        k++;
+    // the text goes out in spans that share a highlight run, a
+    // selection state and the match state
+    const unsigned char *run = row->hl, *runs_end = row->hl + row->hllen;
+    int run_end = 0, cls = HL_NORMAL;
+	int j = start;
+	while(j < end) {
+        while(run_end <= j && run < runs_end)
+            run_end += hlNextRun(&run, &cls);
+        if(j == sel0)
+            abAppend(ab, "\x1b[7m", 4);
+        else if(j == sel1)
+            abAppend(ab, "\x1b[27m", 5);
+		if (k < row->nctrl && row->ctrl[k] == j) {
+            k++;
+  			char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+  			abAppend(ab, "\x1b[7m", 4);
+  			abAppend(ab, &sym, 1);
+  			abAppend(ab, "\x1b[m", 3);
+            if (j >= sel0 && j < sel1)
+                abAppend(ab, "\x1b[7m", 4);
+			if (current_color != -1) {
+   				char buf[16];
+    			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+    			abAppend(ab, buf, clen);
+  			}
+            j++;
+            continue;
+		}
+
+        int stop = run_end < end ? run_end : end;
+        int hlc = cls;
+        if(j >= m0 && j < m1)
+            hlc = HL_MATCH;
+        int bounds[] = {sel0, sel1, m0, m1, k < row->nctrl ? row->ctrl[k] : -1};
+        for(int b = 0; b < 5; b++)
+            if(bounds[b] > j && bounds[b] < stop)
+                stop = bounds[b];
+        // a character is drawn in the class of its first byte
+        while(stop < end && UTF8_CONT(c[stop]))
+            stop++;
+
+		if (hlc == HL_NORMAL) {
+			if(current_color != -1){
+				abAppend(ab, "\x1b[39m", 5);
+				current_color = -1;
+			}
+		} else {
+			int color = editorSyntaxToColor(hlc);
+			if(color != current_color) {
+				current_color = color;
+				char buf[16];
+				int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+				abAppend(ab, buf, clen);
+			}
+		}
+        abAppend(ab, &c[j], stop - j);
+        j = stop;
+	}
+	abAppend(ab, "\x1b[39m\x1b[27m", 10);
 }
 
+// the diff mark of a row, followed by a space
+void editorDrawGutter(struct abuf *ab, int mark) {
+    static const char *marks[] = {
+        "  ", "\x1b[32m+\x1b[39m ", "\x1b[33m~\x1b[39m ", "\x1b[31m-\x1b[39m ", "  "
+    };
+    abAppend(ab, marks[mark], strlen(marks[mark]));
+}
 
-void editorDrawRows(struct abuf *ab){
+// Draws screen rows y0 .. y1 - 1 of the text area, starting wherever the
+// terminal cursor is.
+void editorDrawRows(struct abuf *ab, int y0, int y1){
     int y;
-    for(y = 0; y < E.screenrows ; y++) {
-        int filerow = y + E.rowoff;
+    // the row to draw next, and with wrapping its visual line
+    int filerow = E.rowoff + y0, sub = 0;
+    if(E.wrap) {
+        filerow = editorVlineToRow(E.voff + y0);
+        if(filerow < E.numrows)
+            sub = E.voff + y0 - editorRowVline(filerow);
+    }
+    for(y = y0; y < y1; y++) {
+        if(E.gutter)
+            editorDrawGutter(ab, filerow <= E.numrows && sub == 0 ? editorDiffMark(filerow) : DIFF_SAME);
         if(filerow >= E.numrows) {
             if(E.numrows == 0 && y == E.screenrows/3){
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome), "Tedit Editor -- version %s", TEDIT_VERSION);
-                if(welcomelen > E.screencols)
-                    welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
+                if(welcomelen > editorTextCols())
+                    welcomelen = editorTextCols();
+                int padding = (editorTextCols() - welcomelen) / 2;
                 if(padding){
                     abAppend(ab,"~",1);
                     padding--;
@@ -969,46 +5880,31 @@ void editorDrawRows(struct abuf *ab){
             } else {
                 abAppend(ab, "~", 1);
             }
+            filerow++;
+        } else if(E.wrap) {
+            erow *row = &E.row[filerow];
+            editorDrawRowSpan(ab, row, editorRowWrapStart(row, sub), editorRowWrapEnd(row, sub));
+            if(++sub == editorRowWrapLines(row)) {
+                filerow++;
+                sub = 0;
+            }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if(len < 0)
-                len = 0;
-            if(len > E.screencols)
-                len = E.screencols;
-			char *c = &E.row[filerow].render[E.coloff];
-			unsigned char *hl = &E.row[filerow].hl[E.coloff];
-			int current_color = -1;
-			int j;
-			for(j = 0; j < len; j++) {
-				if (iscntrl(c[j])) {
-          			char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          			abAppend(ab, "\x1b[7m", 4);
-          			abAppend(ab, &sym, 1);
-          			abAppend(ab, "\x1b[m", 3);
-					if (current_color != -1) {
-           				char buf[16];
-            			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            			abAppend(ab, buf, clen);
-          			}
-        		} else if (hl[j] == HL_NORMAL) {
-					if(current_color != -1){
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = -1;
-					}
-					abAppend(ab, &c[j], 1);
-				} else {
-					int color = editorSyntaxToColor(hl[j]);
-					if(color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abAppend(ab, buf, clen);
-					}
-					abAppend(ab, &c[j], 1);
-				}
-			}
-    		
-			abAppend(ab, "\x1b[39m", 5);       
+            erow *row = &E.row[filerow];
+            int start = editorRowColToR(row, E.coloff);
+            int end = editorRowColToR(row, E.coloff + editorTextCols());
+            if(row->rcol) {
+                // a wide character cut by the left edge leaves a gap
+                for(int pad = row->rcol[start] - E.coloff; pad > 0; pad--)
+                    abAppend(ab, " ", 1);
+                // and one cut by the right edge is left out
+                int last = end;
+                while(last > start && UTF8_CONT(row->render[last - 1]))
+                    last--;
+                if(last > start && row->rcol[end] > E.coloff + editorTextCols())
+                    end = last - 1;
+            }
+            editorDrawRowSpan(ab, row, start, end);
+            filerow++;
         }
         
         abAppend(ab,"\x1b[K",3);
@@ -1020,7 +5916,8 @@ void editorDrawStatusBar(struct abuf *ab){
     abAppend(ab, "\x1b[7m", 4);
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft" ,E.cy + 1, E.numrows);
+    long long offset = editorRowOffset(E.cy) + E.cx;
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | @%lld", E.syntax ? E.syntax->filetype : "no ft" ,E.cy + 1, E.numrows, offset);
     if(len > E.screencols)
         len = E.screencols;
     abAppend(ab, status, len);
@@ -1047,25 +5944,71 @@ void editorDrawMessageBar(struct abuf *ab){
 }
 
 void editorRefreshScreen(){
+    PROBE_BEGIN(PERF_SCROLL);
     editorScroll();
+    PROBE_END(PERF_SCROLL);
 
     struct abuf ab = ABUF_INIT;
 
     abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
+    // When only the view moved, the text still on screen is shifted by a
+    // scroll of the text rows (CSI S / CSI T within a scroll region) and
+    // just the lines it exposes are drawn.
+    long long off = E.wrap ? E.voff : E.rowoff;
+    long long shift = off - E.drawn_off;
+    int y0 = 0, y1 = E.screenrows;
+    int partial = E.scroll_only && E.sel_mode == SEL_NONE &&
+                  E.coloff == E.drawn_coloff && llabs(shift) < E.screenrows;
+#ifdef TEDIT_PROFILE
+    if(E.prof.hud)
+        partial = 0;
+#endif
+    char buf[32];
+    if(partial) {
+        if(shift) {
+            int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%lld%c\x1b[r",
+                               E.screenrows, llabs(shift), shift > 0 ? 'S' : 'T');
+            abAppend(&ab, buf, len);
+        }
+        y0 = shift > 0 ? E.screenrows - shift : 0;
+        y1 = shift > 0 ? E.screenrows : -shift;
+    }
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", y0 + 1);
+    abAppend(&ab, buf, strlen(buf));
+
+    PROBE_BEGIN(PERF_DRAW);
+    editorDrawRows(&ab, y0, y1);
+    PROBE_END(PERF_DRAW);
+    editorDrawFinder(&ab);
+    editorDrawGrep(&ab);
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows + 1);
+    abAppend(&ab, buf, strlen(buf));
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
-
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+#ifdef TEDIT_PROFILE
+    editorDrawProfile(&ab);
+#endif
+
+    int cy = E.cy - E.rowoff, cx = E.rx - E.coloff;
+    if(E.wrap)
+        cy = editorWrapCursor(&cx) - E.voff;
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, E.gutter + cx + 1);
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6);
 
+    PROBE_BEGIN(PERF_WRITE);
     write(STDOUT_FILENO, ab.b, ab.len);
+    PROBE_END(PERF_WRITE);
+    PERF_COUNT(bytes_written, ab.len);
     abFree(&ab);
+    E.drawn_off = off;
+    E.drawn_coloff = E.coloff;
+    E.scroll_only = 0;
+#ifdef TEDIT_PROFILE
+    editorEndFrame();
+#endif
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1078,34 +6021,309 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /*** init ***/
 
-void initEditor(){
+// resets the buffer and view state, without touching the terminal
+void initEditorState(){
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
     E.numrows = 0;
+    E.rowcap = 0;
     E.row = NULL;
+    E.lineidx = (struct rowIndex){0};
+    E.words = (struct wordIndex){0};
+    E.wrap = 0;
+    E.voff = 0;
+    E.wrapidx = (struct rowIndex){.stale = 1};
+    E.wrapidx_w = 0;
     E.rowoff = 0;
     E.coloff = 0;
+    E.gutter = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
 	E.syntax = NULL;	
+    E.sel_mode = SEL_NONE;
+    E.clip = (struct clipboard){NULL, 0, 0};
+    E.match_row = -1;
+    E.pending_key = -1;
+    E.scroll_only = 0;
+    E.idle = NULL;
+    E.headless = 0;
+}
+
+void initEditor(){
+    initEditorState();
 
     if(getWindowSize(&E.screenrows, &E.screencols) == -1)
         die("getWindowSize");
+#ifdef TEDIT_PROFILE
+    editorInitProfile();
+#endif
     
     E.screenrows -= 2;
 }
 
+/*** batch mode ***/
+
+// tedit --batch SCRIPT [-jN] FILE...
+//
+// Applies the commands in SCRIPT to every FILE without a terminal, using
+// the same row, search and save functions as the editor. Files are spread
+// over N worker threads (default: one per core); each thread has its own
+// editor state since E is thread local. Commands, one per line:
+//
+//   s/FIND/REPLACE/    replace every occurrence of FIND
+//   d/TEXT/            delete lines containing TEXT
+//   v/TEXT/            delete lines not containing TEXT
+//
+// Any character can stand in for '/'. Modified files are saved in place.
+
+struct batchCommand {
+    char op;
+    char *find;
+    int findlen;
+    char *repl;
+    int repllen;
+};
+
+struct batchJob {
+    struct batchCommand *cmds;
+    int ncmds;
+    char **files;
+    int nfiles;
+    atomic_int next;
+    atomic_int failed;
+    pthread_mutex_t out;
+};
+
+// splits "s/a/b/" into its fields, in place
+int batchParseLine(char *line, struct batchCommand *cmd) {
+    char op = line[0];
+    if(op != 's' && op != 'd' && op != 'v')
+        return -1;
+    char delim = line[1];
+    if(delim == '\0' || delim == '\n')
+        return -1;
+    char *find = &line[2];
+    char *end = strchr(find, delim);
+    if(end == NULL || end == find)
+        return -1;
+    *end = '\0';
+    cmd->op = op;
+    cmd->find = strdup(find);
+    cmd->findlen = end - find;
+    cmd->repl = NULL;
+    cmd->repllen = 0;
+    if(op == 's') {
+        char *repl = end + 1;
+        char *rend = strchr(repl, delim);
+        if(rend == NULL)
+            return -1;
+        *rend = '\0';
+        cmd->repl = strdup(repl);
+        cmd->repllen = rend - repl;
+    }
+    return 0;
+}
+
+int batchLoadScript(const char *path, struct batchJob *job) {
+    FILE *fp = fopen(path, "r");
+    if(!fp)
+        return -1;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int lineno = 0;
+    while((linelen = getline(&line, &linecap, fp)) != -1) {
+        lineno++;
+        while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            line[--linelen] = '\0';
+        if(linelen == 0 || line[0] == '#')
+            continue;
+        job->cmds = realloc(job->cmds, sizeof(struct batchCommand) * (job->ncmds + 1));
+        if(batchParseLine(line, &job->cmds[job->ncmds]) == -1) {
+            fprintf(stderr, "%s:%d: bad command: %s\n", path, lineno, line);
+            free(line);
+            fclose(fp);
+            return -1;
+        }
+        job->ncmds++;
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+// Rewrites each row with matches in one go: the matches are counted, then
+// the new text is written out and set as a single row update.
+void batchReplace(struct batchCommand *cmd) {
+    for(int y = 0; y < E.numrows; y++) {
+        erow *row = &E.row[y];
+        int n = 0;
+        for(int at = 0; (at = editorRowFind(row, at, cmd->find, cmd->findlen)) != -1; at += cmd->findlen)
+            n++;
+        if(n == 0)
+            continue;
+
+        int len = row->size + n * (cmd->repllen - cmd->findlen);
+        char *text = textAlloc(len), *p = text;
+        int from = 0;
+        for(int at = 0; (at = editorRowFind(row, at, cmd->find, cmd->findlen)) != -1; at += cmd->findlen) {
+            memcpy(p, &row->chars[from], at - from);
+            p += at - from;
+            memcpy(p, cmd->repl, cmd->repllen);
+            p += cmd->repllen;
+            from = at + cmd->findlen;
+        }
+        memcpy(p, &row->chars[from], row->size - from);
+        text[len] = '\0';
+        editorRowSetText(row, text, len);
+        // counted as one edit per replacement
+        E.dirty += n - 1;
+    }
+}
+
+// deletes the lines that do (d) or don't (v) contain the text, a run of
+// neighbouring lines at a time
+void batchDeleteLines(struct batchCommand *cmd) {
+    int keep_matches = (cmd->op == 'v');
+    int y = E.numrows - 1;
+    while(y >= 0) {
+        int end = y;
+        while(y >= 0 && (editorRowFind(&E.row[y], 0, cmd->find, cmd->findlen) != -1) != keep_matches)
+            y--;
+        if(y < end)
+            editorDelRows(y + 1, end - y);
+        y--;
+    }
+}
+
+void batchFile(struct batchJob *job, char *path) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if(access(path, R_OK | W_OK) == -1) {
+        pthread_mutex_lock(&job->out);
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        pthread_mutex_unlock(&job->out);
+        job->failed++;
+        return;
+    }
+
+    editorOpen(path);
+    long long bytes = editorRowOffset(E.numrows);
+    for(int i = 0; i < job->ncmds; i++) {
+        if(job->cmds[i].op == 's')
+            batchReplace(&job->cmds[i]);
+        else
+            batchDeleteLines(&job->cmds[i]);
+    }
+    int edits = E.dirty;
+    if(E.dirty) {
+        editorSave();
+        if(E.dirty) {
+            pthread_mutex_lock(&job->out);
+            fprintf(stderr, "%s: %s\n", path, E.statusmsg);
+            pthread_mutex_unlock(&job->out);
+            job->failed++;
+        }
+    }
+    editorDelRows(0, E.numrows);
+    E.cx = E.cy = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    pthread_mutex_lock(&job->out);
+    printf("%s: %lld bytes, %d edits, %.2f ms, %.1f MB/s\n", path, bytes, edits, ms,
+           ms > 0 ? bytes / ms / 1e3 : 0.0);
+    pthread_mutex_unlock(&job->out);
+}
+
+void *batchWorker(void *arg) {
+    struct batchJob *job = arg;
+    initEditorState();
+    E.headless = 1;
+    E.screenrows = 24;
+    E.screencols = 80;
+
+    int i;
+    while((i = job->next++) < job->nfiles)
+        batchFile(job, job->files[i]);
+
+    hlScratchFree();
+    free(E.row);
+    rowIndexFree(&E.lineidx);
+    rowIndexFree(&E.wrapidx);
+    free(E.filename);
+    return NULL;
+}
+
+int editorBatch(int argc, char *argv[]) {
+    if(argc < 4) {
+        fprintf(stderr, "usage: %s --batch SCRIPT [-jN] FILE...\n", argv[0]);
+        return 2;
+    }
+    struct batchJob job = {0};
+    if(batchLoadScript(argv[2], &job) == -1) {
+        if(errno)
+            perror(argv[2]);
+        return 2;
+    }
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 3;
+    if(!strncmp(argv[3], "-j", 2)) {
+        threads = atoi(&argv[3][2]);
+        first = 4;
+    }
+    job.files = &argv[first];
+    job.nfiles = argc - first;
+    if(threads > job.nfiles)
+        threads = job.nfiles;
+    if(threads < 1)
+        threads = 1;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+    pthread_mutex_init(&job.out, NULL);
+
+    J.disabled = 1;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    struct worker *tids = malloc(sizeof(struct worker) * threads);
+    for(long t = 0; t < threads; t++)
+        workerStart(&tids[t], batchWorker, &job);
+    for(long t = 0; t < threads; t++)
+        workerJoin(&tids[t]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(tids);
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("%d files, %ld threads, %.1f ms, %.1f files/s\n", job.nfiles, threads, ms,
+           ms > 0 ? job.nfiles * 1e3 / ms : 0.0);
+    for(int i = 0; i < job.ncmds; i++) {
+        free(job.cmds[i].find);
+        free(job.cmds[i].repl);
+    }
+    free(job.cmds);
+    return job.failed ? 1 : 0;
+}
+
+#ifndef TEDIT_BENCH
 int main(int argc, char *argv[]){
+    if(argc >= 2 && !strcmp(argv[1], "--batch")) {
+        editorLoadSyntaxes();
+        return editorBatch(argc, argv);
+    }
 
     enableRawMode();
     initEditor();
+    editorLoadSyntaxes();
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-O = open | Ctrl-G = goto | Ctrl-B/R = select");
+    editorIndexStart();
     if(argc >= 2){
         editorOpen(argv[1]);
+        editorRecover();
     }
-    
-    editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = find");
 
     while(1){
         editorRefreshScreen();
@@ -1113,3 +6331,106 @@ int main(int argc, char *argv[]){
     }
     return 0;
 }
+#endif
+
+#ifdef TEDIT_BENCH
+/*** benchmarks ***/
+
+// "make bench" builds this instead of the editor: it times the bulk row
+// operations on growing buffers, so the ns/row columns should stay flat.
+
+double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void benchReset() {
+    editorDelRows(0, E.numrows);
+    E.lineidx.stale = 1;
+}
+
+void benchRows(int n, struct textSpan *spans) {
+    benchReset();
+
+    char path[] = "/tmp/tedit-bench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *fp = fdopen(fd, "w");
+    for(int i = 0; i < n; i++)
+        fprintf(fp, "%s\n", spans[i].s);
+    fclose(fp);
+
+    double t0 = benchNow();
+    editorOpen(path);
+    double t1 = benchNow();
+    // a paste of n lines into the middle of an n line buffer
+    editorInsertRows(E.numrows / 2, spans, n);
+    double t2 = benchNow();
+    editorDelRows(E.numrows / 4, n);
+    double t3 = benchNow();
+    unlink(path);
+
+    printf("%10d %10.1f %10.1f %10.1f %8.1f %8.1f %8.1f\n", n,
+           t1 - t0, t2 - t1, t3 - t2,
+           (t1 - t0) * 1e6 / n, (t2 - t1) * 1e6 / n, (t3 - t2) * 1e6 / n);
+}
+
+// Renders one long line of the given repeated text over and over.
+void benchRender(const char *name, const char *unit) {
+    int len = 1 << 16, ulen = strlen(unit);
+    erow row = {0};
+    row.chars = textAlloc(len);
+    for(int i = 0; i < len; i++)
+        row.chars[i] = unit[i % ulen];
+    row.chars[len] = '\0';
+    row.size = len;
+    row.isize = len;
+
+    int reps = 2000;
+    double t0 = benchNow();
+    for(int i = 0; i < reps; i++)
+        editorRenderRow(&row);
+    double t1 = benchNow();
+    printf("%10s %10.1f %10.3f\n", name, (double)len * reps / (t1 - t0) / 1e3,
+           (t1 - t0) * 1e6 / ((double)len * reps));
+    free(row.render);
+    free(row.rmap);
+    free(row.rcol);
+    free(row.ctrl);
+    textRelease(row.chars);
+}
+
+int main(int argc, char *argv[]){
+    int max = argc >= 2 ? atoi(argv[1]) : 2000000;
+    if(max < 8)
+        max = 8;
+
+    E.screenrows = 24;
+    E.screencols = 80;
+    editorLoadSyntaxes();
+
+    struct textSpan *spans = malloc(sizeof(struct textSpan) * max);
+    for(int i = 0; i < max; i++) {
+        char *line = malloc(48);
+        spans[i].base = NULL;
+        spans[i].s = line;
+        spans[i].len = snprintf(line, 48, "    x = f(%d, \"row\"); /* %d */", i, i);
+    }
+
+    printf("%10s %10s %10s %10s %8s %8s %8s\n", "rows", "open ms", "insert ms",
+           "delete ms", "ns/row", "ns/row", "ns/row");
+    for(int n = max / 8; n <= max; n *= 2) {
+        E.filename = NULL;
+        benchRows(n, spans);
+    }
+
+    // editorRenderRow on 64K lines
+    benchReset();
+    printf("\n%10s %10s %10s\n", "line", "MB/s", "ns/byte");
+    benchRender("ascii", "int main(void) { return 0; } ");
+    benchRender("tabs", "\tvalue = compute(a, b, c);\t// note ");
+    benchRender("controls", "abc\x01" "def\x1b[0mghijklmnopqrstuvw");
+    benchRender("utf-8", "caf\xc3\xa9 \xe6\x97\xa5\xe6\x9c\xac ");
+    return 0;
+}
+#endif